@@ -3,36 +3,106 @@
 #include <err.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xcb/randr.h>
+#include <xcb/render.h>
+#include <xcb/shm.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_aux.h>
 #include <xcb/xcb_ewmh.h>
 #include <xcb/xcb_icccm.h>
+#include <xcb/xcb_renderutil.h>
 
 #include "gdbus.h"
 #include "libgwater/xcb/libgwater-xcb.h"
+#include "pixconv.h"
 
 static int size = 24;
+// device pixels per logical pixel, always 1 until we read Xft.dpi or similar
+static int scale = 1;
 
 xcb_connection_t *c;
-xcb_window_t w;
 xcb_visualtype_t *visual;
 xcb_colormap_t colormap;
 uint8_t depth;
 int screen_num;
 
-xcb_rectangle_t win_dim;
-cairo_t *cr;
-cairo_surface_t *surface;
+static xcb_screen_t *screen;
+static uint8_t randr_event_base;
+static guint reconfigure_id = 0;
+static xcb_gcontext_t gc = XCB_NONE;
+
+// MIT-SHM backend: the back buffer is an image surface in a shared memory
+// segment and frames reach the window with ShmPutImage, so no pixels go
+// through the socket. SNI_TRAY_SHM=1 turns it on, and we fall back to the
+// pixmap when the extension or a local connection isn't there
+static gboolean use_shm = FALSE;
+static uint8_t shm_event_base;
+// a frame is waiting for the server to finish reading a segment
+static gboolean frame_waiting = FALSE;
+
+// one window per RandR output in SNI_TRAY_OUTPUT (comma separated, the
+// primary if unset). they all show the same items, drawn from the same
+// surface cache and atlas, so a monitor more costs no D-Bus traffic
+typedef struct TrayWindow {
+  const char *output;  // NULL for the primary
+  xcb_window_t win;
+  xcb_rectangle_t dim;
+  // every frame is drawn into a back buffer and copied to the window from
+  // there, so the window never shows a half drawn frame and an expose is
+  // just a copy. it's a pixmap, or an image surface in a shm segment
+  xcb_pixmap_t buf_pix;
+  xcb_render_picture_t buf_pict;  // buf_pix, for the atlas
+  int buf_width;
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  xcb_shm_seg_t shm_seg;
+  guint8 *shm_data;
+  // the server may still be reading the segment for the last put
+  gboolean shm_busy;
+  // what the last frame changed in the back buffer
+  cairo_region_t *damage;
+  // what the server asked us to repaint since the last batch of events
+  cairo_region_t *exposed;
+  GArray *slot_state;  // SlotState per slot, see draw_tray_window()
+  // set when the window contents can't be trusted, e.g. after the icon
+  // theme changed
+  gboolean damage_all;
+} TrayWindow;
+static GPtrArray *trays = NULL;
+static gchar **output_names = NULL;
 
 rgba_t bg;
 
+// decoded icons, ready to paint. looked up by (path or pixmap serial, size,
+// scale); file entries are only valid while the file's mtime matches
+typedef struct SurfaceEntry {
+  gchar *path;      // icon file, or NULL for an item's pixmap
+  guint64 serial;   // Pixmap serial, 0 for files
+  gint size;
+  gint scale;
+  gint64 mtime;
+  cairo_surface_t *surface;  // NULL if the file couldn't be decoded
+  gsize bytes;
+  GList link;  // our place in surface_lru, data points back to us
+} SurfaceEntry;
+
+// how many bytes of decoded pixels we keep around before evicting
+#define SURFACE_CACHE_BUDGET (4 * 1024 * 1024)
+static GHashTable *surface_cache = NULL;  // SurfaceEntry -> itself
+static GQueue surface_lru = G_QUEUE_INIT;  // most recently used first
+static gsize surface_cache_bytes = 0;
+static guint64 surface_hits = 0, surface_misses = 0, surface_evictions = 0;
+
 xcb_visualtype_t *visual_type(xcb_screen_t *screen, int match_depth) {
   xcb_depth_iterator_t depth_iter = xcb_screen_allowed_depths_iterator(screen);
   if (depth_iter.data) {
@@ -52,88 +122,133 @@ xcb_visualtype_t *visual_type(xcb_screen_t *screen, int match_depth) {
   return NULL;
 }
 
-void mon_select(xcb_screen_t *s, xcb_rectangle_t *mon_dim, char *mon_name) {
+// startup phase timings, so slow (remote) X connections can be measured
+static gint64 phase_start;
+static void phase_done(const char *phase) {
+  gint64 now = g_get_monotonic_time();
+  printf("startup: %s took %.2fms\n", phase, (now - phase_start) / 1000.0);
+  phase_start = now;
+}
+
+// every request goes out before we wait for any reply, so picking the
+// monitor costs three round trips however many outputs there are. returns
+// FALSE (and leaves mon_dim alone) if no monitor is usable
+gboolean mon_select(xcb_screen_t *s, xcb_rectangle_t *mon_dim,
+                    const char *mon_name) {
+  xcb_randr_get_screen_resources_current_cookie_t res_ck =
+      xcb_randr_get_screen_resources_current(c, s->root);
+  xcb_randr_get_output_primary_cookie_t primary_ck =
+      xcb_randr_get_output_primary(c, s->root);
   xcb_randr_get_screen_resources_current_reply_t *r =
-      xcb_randr_get_screen_resources_current_reply(
-          c, xcb_randr_get_screen_resources_current(c, s->root), NULL);
-  if (!r) errx(1, "Failed to get screen resources");
+      xcb_randr_get_screen_resources_current_reply(c, res_ck, NULL);
+  xcb_randr_get_output_primary_reply_t *primary =
+      xcb_randr_get_output_primary_reply(c, primary_ck, NULL);
+  if (!r) {
+    warnx("Failed to get screen resources");
+    free(primary);
+    return FALSE;
+  }
 
   int mon_total = xcb_randr_get_screen_resources_current_outputs_length(r);
   xcb_randr_output_t *o = xcb_randr_get_screen_resources_current_outputs(r);
 
-  if (mon_name != NULL) {
-    for (int i = 0; i < mon_total; i++) {
-      xcb_randr_get_output_info_reply_t *out = xcb_randr_get_output_info_reply(
-          c, xcb_randr_get_output_info(c, o[i], XCB_CURRENT_TIME), NULL);
-
-      if (out == NULL || out->crtc == XCB_NONE ||
-          out->connection == XCB_RANDR_CONNECTION_DISCONNECTED)
-        continue;
-
-      xcb_randr_get_crtc_info_reply_t *crtc = xcb_randr_get_crtc_info_reply(
-          c, xcb_randr_get_crtc_info(c, out->crtc, XCB_CURRENT_TIME), NULL);
-      if (!crtc) {
-        free(r);
-        errx(1, "Failed to get crtc info");
-      }
+  xcb_randr_get_output_info_cookie_t *out_ck =
+      g_new(xcb_randr_get_output_info_cookie_t, mon_total);
+  for (int i = 0; i < mon_total; i++)
+    out_ck[i] = xcb_randr_get_output_info(c, o[i], XCB_CURRENT_TIME);
+  xcb_randr_get_output_info_reply_t **out =
+      g_new0(xcb_randr_get_output_info_reply_t *, mon_total);
+  for (int i = 0; i < mon_total; i++)
+    out[i] = xcb_randr_get_output_info_reply(c, out_ck[i], NULL);
 
-      if (!strcmp(mon_name, (char *)xcb_randr_get_output_info_name(out))) {
-        *mon_dim =
-            (xcb_rectangle_t){crtc->x, crtc->y, crtc->width, crtc->height};
-        break;
-      }
-      free(crtc);
-      free(out);
-    }
+  // the monitor we want: the named one, or the primary as fallback, or the
+  // first usable one when no primary is set (common with a single monitor)
+  int want = -1, want_primary = -1, want_first = -1;
+  size_t name_len = mon_name ? strlen(mon_name) : 0;
+  for (int i = 0; i < mon_total; i++) {
+    if (out[i] == NULL || out[i]->crtc == XCB_NONE ||
+        out[i]->connection == XCB_RANDR_CONNECTION_DISCONNECTED)
+      continue;
+    if (want_first < 0) want_first = i;
+    // output names aren't nul terminated
+    if (mon_name != NULL &&
+        xcb_randr_get_output_info_name_length(out[i]) == (int)name_len &&
+        !memcmp(mon_name, xcb_randr_get_output_info_name(out[i]), name_len))
+      want = i;
+    if (primary != NULL && o[i] == primary->output) want_primary = i;
+  }
+  if (want < 0) {
+    if (mon_name != NULL) warnx("Using primary monitor as fallback");
+    want = want_primary >= 0 ? want_primary : want_first;
   }
-  if (!mon_dim->width || !mon_dim->height) {
-    warnx("Using primary monitor as fallback");
-    // get primary output as fallback
-    xcb_randr_get_output_primary_reply_t *primary =
-        xcb_randr_get_output_primary_reply(
-            c, xcb_randr_get_output_primary(c, s->root), NULL);
-    xcb_randr_get_output_info_reply_t *pri = xcb_randr_get_output_info_reply(
-        c, xcb_randr_get_output_info(c, primary->output, XCB_CURRENT_TIME),
+  xcb_randr_get_crtc_info_reply_t *crtc = NULL;
+  if (want >= 0)
+    crtc = xcb_randr_get_crtc_info_reply(
+        c, xcb_randr_get_crtc_info(c, out[want]->crtc, XCB_CURRENT_TIME),
         NULL);
-    xcb_randr_get_crtc_info_reply_t *crtc = xcb_randr_get_crtc_info_reply(
-        c, xcb_randr_get_crtc_info(c, pri->crtc, XCB_CURRENT_TIME), NULL);
+  if (crtc != NULL)
     *mon_dim = (xcb_rectangle_t){crtc->x, crtc->y, crtc->width, crtc->height};
-    free(crtc);
-    free(pri);
-    free(primary);
-  }
+  else
+    warnx("No usable monitor found");
 
+  for (int i = 0; i < mon_total; i++) free(out[i]);
+  g_free(out);
+  g_free(out_ck);
+  free(primary);
+  free(r);
+  if (crtc == NULL) return FALSE;
+  free(crtc);
   printf("%d %d %d %d\n", mon_dim->x, mon_dim->y, mon_dim->width,
          mon_dim->height);
-  free(r);
+  return TRUE;
+}
+// kept around to update the struts when windows move or resize
+static xcb_ewmh_connection_t *ewmh = NULL;
+
+// reserve the space the tray covers at the top of its monitor
+static void update_strut(TrayWindow *t) {
+  xcb_ewmh_wm_strut_partial_t strut = {
+      0, 0, t->dim.height, 0, 0, 0, 0, 0, t->dim.x, t->dim.x + t->dim.width,
+      0, 0};
+  xcb_ewmh_set_wm_strut(ewmh, t->win, 0, 0, t->dim.height, 0);
+  xcb_ewmh_set_wm_strut_partial(ewmh, t->win, strut);
 }
-void conf_win(xcb_screen_t *s, xcb_window_t w) {
-  xcb_ewmh_connection_t *ewmh = malloc(sizeof(xcb_ewmh_connection_t));
-  if (!xcb_ewmh_init_atoms_replies(ewmh, xcb_ewmh_init_atoms(c, ewmh), NULL))
+
+void conf_win(xcb_screen_t *s, TrayWindow *t) {
+  xcb_window_t w = t->win;
+  // the atoms (on the first window) and the window tree are requested
+  // together
+  xcb_intern_atom_cookie_t *atom_ck = NULL;
+  if (ewmh == NULL) {
+    ewmh = malloc(sizeof(xcb_ewmh_connection_t));
+    atom_ck = xcb_ewmh_init_atoms(c, ewmh);
+  }
+  xcb_query_tree_cookie_t tree_ck = xcb_query_tree(c, s->root);
+  if (atom_ck != NULL && !xcb_ewmh_init_atoms_replies(ewmh, atom_ck, NULL))
     errx(1, "Failed to initialize EWMH atoms");
 
   xcb_atom_t test_atom[2] = {ewmh->_NET_WM_STATE_STICKY,
                              ewmh->_NET_WM_STATE_ABOVE};
   xcb_ewmh_set_wm_state(ewmh, w, 2, test_atom);
   xcb_ewmh_set_wm_window_type(ewmh, w, 1, &ewmh->_NET_WM_WINDOW_TYPE_DOCK);
-  xcb_ewmh_wm_strut_partial_t strut = {
-      0, 0, win_dim.height, 0, 0, 0, 0, 0, win_dim.x, win_dim.x + win_dim.width,
-      0, 0};
-  xcb_ewmh_set_wm_strut(ewmh, w, 0, 0, win_dim.height, 0);
-  xcb_ewmh_set_wm_strut_partial(ewmh, w, strut);
+  update_strut(t);
 
   // set bspwm windows to be above the bar
-  xcb_query_tree_reply_t *qtree =
-      xcb_query_tree_reply(c, xcb_query_tree(c, s->root), NULL);
+  xcb_query_tree_reply_t *qtree = xcb_query_tree_reply(c, tree_ck, NULL);
   if (qtree == NULL) errx(1, "Failed to query window tree");
   xcb_window_t *wins = xcb_query_tree_children(qtree);
+  int n_wins = xcb_query_tree_children_length(qtree);
 
-  for (int i = 0; i < xcb_query_tree_children_length(qtree); i++) {
+  // ask every window for its class first, then go through the answers
+  xcb_get_property_cookie_t *class_ck =
+      g_new(xcb_get_property_cookie_t, n_wins);
+  for (int i = 0; i < n_wins; i++)
+    class_ck[i] = xcb_icccm_get_wm_class(c, wins[i]);
+  for (int i = 0; i < n_wins; i++) {
     xcb_window_t found_win = wins[i];
     // apparently class cannot be a pointer
     xcb_icccm_get_wm_class_reply_t class;
-    if (xcb_icccm_get_wm_class_reply(c, xcb_icccm_get_wm_class(c, found_win),
-                                     &class, NULL)) {
+    if (xcb_icccm_get_wm_class_reply(c, class_ck[i], &class, NULL)) {
       if (!strcmp("Bspwm", class.class_name) &&
           !strcmp("root", class.instance_name)) {
         uint32_t stack_mask[2] = {found_win, XCB_STACK_MODE_ABOVE};
@@ -141,58 +256,64 @@ void conf_win(xcb_screen_t *s, xcb_window_t w) {
             c, w, XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE,
             stack_mask);
       }
+      xcb_icccm_get_wm_class_reply_wipe(&class);
     }
   }
 
+  g_free(class_ck);
   free(qtree);
   /*
   uint32_t shadow = 0;
   xcb_change_property(c, XCB_PROP_MODE_REPLACE, w, xcb_get_atom(c,
   "_COMPTON_SHADOW"), XCB_ATOM_CARDINAL, 32, 1, &shadow);
   */
-  xcb_ewmh_connection_wipe(ewmh);
-  free(ewmh);
 }
 
-xcb_window_t main_win_init(xcb_screen_t *s) {
+xcb_window_t main_win_init(xcb_screen_t *s, TrayWindow *t) {
   xcb_window_t w = xcb_generate_id(c);
+  xcb_void_cookie_t cmap_ck = {0};
+
+  // every window uses the visual and colormap of the first
+  if (visual == NULL) {
+    depth = XCB_COPY_FROM_PARENT;
+    visual = visual_type(s, 32);
+    colormap = s->default_colormap;
+    if (visual != NULL) {
+      depth = xcb_aux_get_depth_of_visual(s, visual->visual_id);
+      colormap = xcb_generate_id(c);
+      cmap_ck = xcb_create_colormap_checked(c, XCB_COLORMAP_ALLOC_NONE,
+                                            colormap, s->root,
+                                            visual->visual_id);
+      printf("colormap: %d %d\n", colormap, s->default_colormap);
+    } else
+      ;
+    // TODO: switch to one version of visualtype function
+    // visual = get_visualtype(s);
 
-  depth = XCB_COPY_FROM_PARENT;
-  visual = visual_type(s, 32);
-  colormap = s->default_colormap;
-  if (visual != NULL) {
-    depth = xcb_aux_get_depth_of_visual(s, visual->visual_id);
-    colormap = xcb_generate_id(c);
-    if (xcb_request_check(
-            c, xcb_create_colormap_checked(c, XCB_COLORMAP_ALLOC_NONE, colormap,
-                                           s->root, visual->visual_id)) != NULL)
-      errx(1, "aiodojf");
-    printf("colormap: %d %d\n", colormap, s->default_colormap);
-  } else
-    ;
-  // TODO: switch to one version of visualtype function
-  // visual = get_visualtype(s);
-
-  printf("depth: %d\n", depth);
+    printf("depth: %d\n", depth);
+  }
   // IMPORTANT: NEED TO DEFINE BACK AND BORDER PIXELS
   uint32_t mask[] = {s->black_pixel, s->black_pixel, 1,
                      XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS,
                      colormap};
 
-  if (xcb_request_check(c, xcb_create_window_checked(
-                               c, depth, w, s->root, win_dim.x, win_dim.y,
-                               win_dim.width, win_dim.height, 0,
-                               XCB_WINDOW_CLASS_INPUT_OUTPUT, visual->visual_id,
-                               XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL |
-                                   XCB_CW_OVERRIDE_REDIRECT |
-                                   XCB_CW_EVENT_MASK | XCB_CW_COLORMAP,
-                               mask)) != NULL) {
+  xcb_void_cookie_t win_ck = xcb_create_window_checked(
+      c, depth, w, s->root, t->dim.x, t->dim.y, t->dim.width, t->dim.height, 0,
+      XCB_WINDOW_CLASS_INPUT_OUTPUT, visual->visual_id,
+      XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT |
+          XCB_CW_EVENT_MASK | XCB_CW_COLORMAP,
+      mask);
+  // one round trip for both
+  if (cmap_ck.sequence && xcb_request_check(c, cmap_ck) != NULL)
+    errx(1, "aiodojf");
+  if (xcb_request_check(c, win_ck) != NULL) {
     errx(1, "dank");
   }
   char *title = "SNI Tray";
   xcb_change_property(c, XCB_PROP_MODE_REPLACE, w, XCB_ATOM_WM_NAME,
                       XCB_ATOM_STRING, 8, strlen(title), title);
-  conf_win(s, w);
+  t->win = w;
+  conf_win(s, t);
   xcb_map_window(c, w);
   return w;
 }
@@ -203,69 +324,177 @@ static cairo_surface_t *draw_surface_from_pixbuf(GdkPixbuf *buf) {
   guchar *pixels = gdk_pixbuf_get_pixels(buf);
   int channels = gdk_pixbuf_get_n_channels(buf);
   cairo_surface_t *surface;
-  int cairo_stride;
-  unsigned char *cairo_pixels;
 
   cairo_format_t format = CAIRO_FORMAT_ARGB32;
   if (channels == 3) format = CAIRO_FORMAT_RGB24;
 
   surface = cairo_image_surface_create(format, width, height);
   cairo_surface_flush(surface);
-  cairo_stride = cairo_image_surface_get_stride(surface);
-  cairo_pixels = cairo_image_surface_get_data(surface);
-
-  for (int y = 0; y < height; y++) {
-    guchar *row = pixels;
-    uint32_t *cairo = (uint32_t *)cairo_pixels;
-    for (int x = 0; x < width; x++) {
-      if (channels == 3) {
-        uint8_t r = *row++;
-        uint8_t g = *row++;
-        uint8_t b = *row++;
-        *cairo++ = (r << 16) | (g << 8) | b;
-      } else {
-        uint8_t r = *row++;
-        uint8_t g = *row++;
-        uint8_t b = *row++;
-        uint8_t a = *row++;
-        double alpha = a / 255.0;
-        r = r * alpha;
-        g = g * alpha;
-        b = b * alpha;
-        *cairo++ = (a << 24) | (r << 16) | (g << 8) | b;
-      }
-    }
-    pixels += pix_stride;
-    cairo_pixels += cairo_stride;
-  }
+  if (channels == 3)
+    pixconv_rgb_to_rgb24(pixels, pix_stride,
+                         cairo_image_surface_get_data(surface),
+                         cairo_image_surface_get_stride(surface), width,
+                         height);
+  else
+    pixconv_rgba_to_argb32(pixels, pix_stride,
+                           cairo_image_surface_get_data(surface),
+                           cairo_image_surface_get_stride(surface), width,
+                           height);
 
   cairo_surface_mark_dirty(surface);
   return surface;
 }
 
-cairo_surface_t *image_to_surface(char *path) {
+// decode path so that it fits in a px by px box. vector images are
+// rasterized at that size and bigger bitmaps are scaled down once here (jpeg
+// even decodes at the reduced size), smaller bitmaps are left alone
+static GdkPixbuf *load_pixbuf_at_size(char *path, int px, GError **err) {
+  gint w, h;
+  GdkPixbufFormat *fmt = gdk_pixbuf_get_file_info(path, &w, &h);
+  if (fmt != NULL && !gdk_pixbuf_format_is_scalable(fmt) && w <= px &&
+      h <= px)
+    return gdk_pixbuf_new_from_file(path, err);
+  return gdk_pixbuf_new_from_file_at_scale(path, px, px, TRUE, err);
+}
+
+cairo_surface_t *image_to_surface(char *path, int px) {
   GError *err = NULL;
   cairo_surface_t *ret = NULL;
-  GdkPixbuf *gbuf = gdk_pixbuf_new_from_file(path, &err);
+  GdkPixbuf *gbuf = load_pixbuf_at_size(path, px, &err);
   if (!gbuf) {
-    printf("error\n");
+    fprintf(stderr, "Error loading %s: %s\n", path, err->message);
+    g_error_free(err);
     return NULL;
   }
   ret = draw_surface_from_pixbuf(gbuf);
   g_object_unref(gbuf);
   return ret;
 }
-cairo_surface_t *pixmap_to_surface(Pixmap *px) {
-  cairo_surface_t *ret = NULL;
-  // TODO check cairo format
-  unsigned char *data = (unsigned char *)g_bytes_get_data(px->pixmap, NULL);
-  // ret = cairo_image_surface_create_for_data(px->pixmap,
-  // CAIRO_FORMAT_ARGB32, px->width, px->height,
-  ret = cairo_image_surface_create_for_data(
-      data, CAIRO_FORMAT_ARGB32, px->width, px->height,
-      cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, px->width));
-  return ret;
+// convert px once into something we can blit straight into a slot: byte
+// swapped, premultiplied and, if the app didn't send our size, scaled to fit
+cairo_surface_t *pixmap_to_surface(Pixmap *px, int slot) {
+  cairo_surface_t *ret =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, px->width, px->height);
+  cairo_surface_flush(ret);
+  pixconv_argb_be_to_argb32(px->data, px->width * 4,
+                            cairo_image_surface_get_data(ret),
+                            cairo_image_surface_get_stride(ret), px->width,
+                            px->height);
+  cairo_surface_mark_dirty(ret);
+  if (px->width <= slot && px->height <= slot) return ret;
+
+  double f = MIN((double)slot / px->width, (double)slot / px->height);
+  cairo_surface_t *scaled = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, MAX(1, px->width * f + 0.5),
+      MAX(1, px->height * f + 0.5));
+  cairo_t *sc = cairo_create(scaled);
+  cairo_scale(sc, f, f);
+  cairo_set_source_surface(sc, ret, 0, 0);
+  cairo_pattern_set_filter(cairo_get_source(sc), CAIRO_FILTER_GOOD);
+  cairo_paint(sc);
+  cairo_destroy(sc);
+  cairo_surface_destroy(ret);
+  return scaled;
+}
+
+static guint surface_entry_hash(gconstpointer key) {
+  const SurfaceEntry *e = key;
+  guint h = e->path ? g_str_hash(e->path)
+                     : (guint)(e->serial ^ (e->serial >> 32));
+  return h ^ (e->size * 31) ^ (e->scale << 16);
+}
+
+static gboolean surface_entry_equal(gconstpointer a, gconstpointer b) {
+  const SurfaceEntry *x = a, *y = b;
+  return x->size == y->size && x->scale == y->scale &&
+         x->serial == y->serial && g_strcmp0(x->path, y->path) == 0;
 }
+
+static void surface_entry_free(gpointer data) {
+  SurfaceEntry *e = data;
+  g_queue_unlink(&surface_lru, &e->link);
+  surface_cache_bytes -= e->bytes;
+  if (e->surface) cairo_surface_destroy(e->surface);
+  g_free(e->path);
+  g_free(e);
+}
+
+static void surface_cache_trim() {
+  // never evict the entry that was just added, it's about to be painted
+  while (surface_cache_bytes > SURFACE_CACHE_BUDGET &&
+         surface_lru.length > 1) {
+    GList *oldest = g_queue_peek_tail_link(&surface_lru);
+    g_hash_table_remove(surface_cache, oldest->data);
+    surface_evictions++;
+  }
+}
+
+// the cached entry for key, if there is one and its mtime still matches
+static SurfaceEntry *surface_cache_lookup(const SurfaceEntry *key) {
+  if (surface_cache == NULL)
+    surface_cache = g_hash_table_new_full(
+        surface_entry_hash, surface_entry_equal, NULL, surface_entry_free);
+  SurfaceEntry *e = g_hash_table_lookup(surface_cache, key);
+  if (e != NULL && e->mtime == key->mtime) {
+    surface_hits++;
+    g_queue_unlink(&surface_lru, &e->link);
+    g_queue_push_head_link(&surface_lru, &e->link);
+    return e;
+  }
+  // not cached, or the file changed since we decoded it
+  if (e != NULL) g_hash_table_remove(surface_cache, e);
+  surface_misses++;
+  return NULL;
+}
+
+// takes ownership of surface
+static cairo_surface_t *surface_cache_insert(const SurfaceEntry *key,
+                                             cairo_surface_t *surface) {
+  SurfaceEntry *e = g_new0(SurfaceEntry, 1);
+  *e = *key;
+  e->path = g_strdup(key->path);
+  e->surface = surface;
+  if (surface)
+    e->bytes = cairo_image_surface_get_stride(surface) *
+               cairo_image_surface_get_height(surface);
+  e->link = (GList){e, NULL, NULL};
+  g_hash_table_add(surface_cache, e);
+  g_queue_push_head_link(&surface_lru, &e->link);
+  surface_cache_bytes += e->bytes;
+  surface_cache_trim();
+  return surface;
+}
+
+// the decoded surface for path, owned by the cache
+static cairo_surface_t *cached_image_surface(char *path) {
+  struct stat st;
+  SurfaceEntry key = {.path = path, .size = size, .scale = scale};
+  if (stat(path, &st) == 0)
+    key.mtime = (gint64)st.st_mtim.tv_sec * G_USEC_PER_SEC +
+                st.st_mtim.tv_nsec / 1000;
+  SurfaceEntry *e = surface_cache_lookup(&key);
+  if (e != NULL) return e->surface;
+  return surface_cache_insert(&key, image_to_surface(path, size * scale));
+}
+
+// the converted surface for px, owned by the cache
+static cairo_surface_t *cached_pixmap_surface(Pixmap *px) {
+  SurfaceEntry key = {.serial = px->serial, .size = size, .scale = scale};
+  SurfaceEntry *e = surface_cache_lookup(&key);
+  if (e != NULL) return e->surface;
+  return surface_cache_insert(&key, pixmap_to_surface(px, size * scale));
+}
+
+void surface_cache_report() {
+  printf("surface cache: %u entries, %" G_GSIZE_FORMAT
+         "/%d bytes, %" G_GUINT64_FORMAT
+         " hits, %" G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT
+         " evictions\n",
+         surface_cache ? g_hash_table_size(surface_cache) : 0,
+         surface_cache_bytes, SURFACE_CACHE_BUDGET, surface_hits,
+         surface_misses, surface_evictions);
+}
+
 // void cairo_reset_surface(cairo_t *cr, rgba_t *bg) {
 void cairo_reset_surface(cairo_t *cr) {
   cairo_save(cr);
@@ -275,91 +504,648 @@ void cairo_reset_surface(cairo_t *cr) {
   cairo_paint(cr);
   cairo_restore(cr);
 }
-void draw_image(cairo_t *dest, char *path, int x) {
-  printf("Drawing %s\n", path);
-  cairo_surface_t *kek = image_to_surface(path);
+// icons smaller than the slot are centered in it
+static void paint_in_slot(cairo_t *dest, cairo_surface_t *icon, int x) {
+  int w = cairo_image_surface_get_width(icon) / scale;
+  int h = cairo_image_surface_get_height(icon) / scale;
   // cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-  cairo_set_source_surface(dest, kek, x, 0);
+  cairo_set_source_surface(dest, icon, x + (size - w) / 2, (size - h) / 2);
   cairo_paint(dest);
-  cairo_surface_destroy(kek);
+}
+void draw_image(cairo_t *dest, char *path, int x) {
+  cairo_surface_t *kek = cached_image_surface(path);
+  if (kek != NULL) paint_in_slot(dest, kek, x);
 }
 void draw_pixmap(cairo_t *dest, Pixmap *px, int x) {
-  cairo_surface_t *lol = pixmap_to_surface(px);
-  cairo_set_source_surface(dest, lol, x, 0);
-  cairo_paint(dest);
-  cairo_surface_destroy(lol);
+  cairo_surface_t *lol = cached_pixmap_surface(px);
+  if (lol != NULL) paint_in_slot(dest, lol, x);
+}
+// stands in for an item whose properties haven't arrived yet
+void draw_placeholder(cairo_t *dest, int x) {
+  cairo_save(dest);
+  cairo_set_source_rgba(dest, 1, 1, 1, 0.25);
+  cairo_rectangle(dest, x + size / 4, size / 4, size / 2, size / 2);
+  cairo_fill(dest);
+  cairo_restore(dest);
+}
+
+// server-side icon atlas, used with the pixmap backend: every decoded icon
+// is uploaded once into a cell of a 32 bit pixmap, and slots are drawn with
+// XRender requests that reference it. a cell is held through the cached
+// surface's user data, and freed when the surface is evicted or, once the
+// atlas is full, when a newer icon needs the cell of the least recently used
+// surface. SNI_TRAY_ATLAS=0 turns it off
+#define ATLAS_COLS 16
+#define ATLAS_ROWS 16
+static gboolean use_atlas = FALSE;
+static xcb_pixmap_t atlas_pix;
+static xcb_gcontext_t atlas_gc;
+static xcb_render_picture_t atlas_pict;
+static xcb_render_pictformat_t buf_format;
+static int cell_size;
+static gboolean atlas_used[ATLAS_COLS * ATLAS_ROWS];
+static guint atlas_cells = 0;
+static guint64 atlas_uploads = 0, atlas_composites = 0, atlas_misses = 0;
+static guint64 atlas_reclaims = 0;
+static const cairo_user_data_key_t atlas_key;
+
+typedef struct AtlasCell {
+  guint index;
+  int width, height;
+} AtlasCell;
+
+static void atlas_cell_free(void *data) {
+  AtlasCell *cell = data;
+  atlas_used[cell->index] = FALSE;
+  atlas_cells--;
+  g_free(cell);
+}
+
+static gboolean atlas_init() {
+  const xcb_query_extension_reply_t *ext =
+      xcb_get_extension_data(c, &xcb_render_id);
+  if (ext == NULL || !ext->present) return FALSE;
+  const xcb_render_query_pict_formats_reply_t *formats =
+      xcb_render_util_query_formats(c);
+  if (formats == NULL) return FALSE;
+  xcb_render_pictforminfo_t *argb =
+      xcb_render_util_find_standard_format(formats, XCB_PICT_STANDARD_ARGB_32);
+  xcb_render_pictvisual_t *pv =
+      xcb_render_util_find_visual_format(formats, visual->visual_id);
+  if (argb == NULL || pv == NULL) return FALSE;
+  buf_format = pv->format;
+  cell_size = size * scale;
+  atlas_pix = xcb_generate_id(c);
+  xcb_create_pixmap(c, 32, atlas_pix, screen->root, ATLAS_COLS * cell_size,
+                    ATLAS_ROWS * cell_size);
+  atlas_gc = xcb_generate_id(c);
+  xcb_create_gc(c, atlas_gc, atlas_pix, 0, NULL);
+  atlas_pict = xcb_generate_id(c);
+  xcb_render_create_picture(c, atlas_pict, atlas_pix, argb->id, 0, NULL);
+  return TRUE;
+}
+
+// t's back buffer changed, point its picture at the new one
+static void atlas_bind_buffer(TrayWindow *t) {
+  if (t->buf_pict != XCB_NONE) xcb_render_free_picture(c, t->buf_pict);
+  t->buf_pict = xcb_generate_id(c);
+  xcb_render_create_picture(c, t->buf_pict, t->buf_pix, buf_format, 0, NULL);
+}
+
+// the atlas is full: take the cell of the least recently drawn surface that
+// has one. that surface stays cached and gets a cell again when it's next
+// drawn. FALSE if no surface but keep holds a cell
+static gboolean atlas_reclaim(cairo_surface_t *keep) {
+  for (GList *l = surface_lru.tail; l != NULL; l = l->prev) {
+    SurfaceEntry *e = l->data;
+    if (e->surface == NULL || e->surface == keep ||
+        cairo_surface_get_user_data(e->surface, &atlas_key) == NULL)
+      continue;
+    // runs atlas_cell_free()
+    cairo_surface_set_user_data(e->surface, &atlas_key, NULL, NULL);
+    atlas_reclaims++;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// the cell holding icon, uploading it first if it isn't in the atlas yet.
+// NULL if it doesn't fit
+static AtlasCell *atlas_cell_for(cairo_surface_t *icon) {
+  AtlasCell *cell = cairo_surface_get_user_data(icon, &atlas_key);
+  if (cell != NULL) return cell;
+
+  int width = cairo_image_surface_get_width(icon);
+  int height = cairo_image_surface_get_height(icon);
+  int stride = cairo_image_surface_get_stride(icon);
+  if (width > cell_size || height > cell_size || stride != width * 4)
+    return NULL;
+  if (atlas_cells == G_N_ELEMENTS(atlas_used) && !atlas_reclaim(icon))
+    return NULL;
+  guint index = 0;
+  while (index < G_N_ELEMENTS(atlas_used) && atlas_used[index]) index++;
+  if (index == G_N_ELEMENTS(atlas_used)) return NULL;
+
+  cairo_surface_flush(icon);
+  guint8 *data = cairo_image_surface_get_data(icon);
+  guint8 *opaque = NULL;
+  if (cairo_image_surface_get_format(icon) == CAIRO_FORMAT_RGB24) {
+    // the atlas has alpha, and the unused byte of RGB24 isn't guaranteed
+    // to be 0xff
+    opaque = g_memdup2(data, stride * height);
+    for (int i = 0; i < width * height; i++)
+      ((uint32_t *)opaque)[i] |= 0xff000000;
+    data = opaque;
+  }
+  xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, atlas_pix, atlas_gc, width,
+                height, (index % ATLAS_COLS) * cell_size,
+                (index / ATLAS_COLS) * cell_size, 0, 32, stride * height,
+                data);
+  g_free(opaque);
+
+  cell = g_new(AtlasCell, 1);
+  *cell = (AtlasCell){index, width, height};
+  atlas_used[index] = TRUE;
+  atlas_cells++;
+  atlas_uploads++;
+  cairo_surface_set_user_data(icon, &atlas_key, cell, atlas_cell_free);
+  return cell;
+}
+
+// XRender colors are 16 bit and premultiplied
+static xcb_render_color_t render_color(double r, double g, double b,
+                                       double a) {
+  return (xcb_render_color_t){r * a * 0xffff, g * a * 0xffff, b * a * 0xffff,
+                              a * 0xffff};
+}
+
+static void atlas_draw_slot(TrayWindow *t, ItemView *data, int x) {
+  xcb_rectangle_t slot = {x, 0, size, size};
+  xcb_render_fill_rectangles(
+      c, XCB_RENDER_PICT_OP_SRC, t->buf_pict,
+      render_color(bg.r / 255.0, bg.g / 255.0, bg.b / 255.0, bg.a / 255.0), 1,
+      &slot);
+  cairo_surface_t *icon = NULL;
+  if (!data->loaded) {
+    xcb_rectangle_t r = {x + size / 4, size / 4, size / 2, size / 2};
+    xcb_render_fill_rectangles(c, XCB_RENDER_PICT_OP_OVER, t->buf_pict,
+                               render_color(1, 1, 1, 0.25), 1, &r);
+  } else if (data->icon_path != NULL) {
+    icon = cached_image_surface(data->icon_path);
+  } else if (data->icon_pixmap != NULL) {
+    icon = cached_pixmap_surface(data->icon_pixmap);
+  }
+  if (icon == NULL) return;
+
+  AtlasCell *cell = atlas_cell_for(icon);
+  if (cell == NULL) {
+    // too big, or the atlas is full: let cairo send the pixels this time
+    atlas_misses++;
+    cairo_surface_mark_dirty_rectangle(t->surface, x, 0, size, size);
+    cairo_save(t->cr);
+    cairo_rectangle(t->cr, x, 0, size, size);
+    cairo_clip(t->cr);
+    paint_in_slot(t->cr, icon, x);
+    cairo_restore(t->cr);
+    cairo_surface_flush(t->surface);
+    return;
+  }
+  atlas_composites++;
+  xcb_render_composite(c, XCB_RENDER_PICT_OP_OVER, atlas_pict, XCB_NONE,
+                       t->buf_pict, (cell->index % ATLAS_COLS) * cell_size,
+                       (cell->index / ATLAS_COLS) * cell_size, 0, 0,
+                       x + (size - cell->width) / 2, (size - cell->height) / 2,
+                       cell->width, cell->height);
 }
+
 // only supports horizontally oriented tray for now
-void resize_window(guint items) {
+void resize_window(TrayWindow *t, guint items) {
   printf("resizing width to %d\n", items * size);
   // or get height and multiply by items
   uint32_t values[] = {items * size};
-  xcb_configure_window(c, w, XCB_CONFIG_WINDOW_WIDTH, (const uint32_t *)values);
-  cairo_surface_flush(surface);
-  cairo_xcb_surface_set_size(surface, size, values[0]);
+  xcb_configure_window(c, t->win, XCB_CONFIG_WINDOW_WIDTH,
+                       (const uint32_t *)values);
+  t->dim.width = values[0];
+  update_strut(t);
 }
+static gboolean shm_available() {
+  const xcb_query_extension_reply_t *ext =
+      xcb_get_extension_data(c, &xcb_shm_id);
+  if (ext == NULL || !ext->present) return FALSE;
+  xcb_shm_query_version_reply_t *v =
+      xcb_shm_query_version_reply(c, xcb_shm_query_version(c), NULL);
+  if (v == NULL) return FALSE;
+  free(v);
+  // cairo can only draw the 32 bits per pixel formats
+  if (depth != 24 && depth != 32) return FALSE;
+  shm_event_base = ext->first_event;
+  return TRUE;
+}
+
+static void shm_release(TrayWindow *t) {
+  if (t->shm_data == NULL) return;
+  // the server detaches after it's done with any put still in its queue
+  xcb_shm_detach(c, t->shm_seg);
+  shmdt(t->shm_data);
+  t->shm_data = NULL;
+}
+
+static cairo_surface_t *shm_create_buffer(TrayWindow *t, int width) {
+  cairo_format_t format =
+      depth == 32 ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+  int stride = cairo_format_stride_for_width(format, width);
+  int id = shmget(IPC_PRIVATE, stride * size, IPC_CREAT | 0600);
+  if (id < 0) return NULL;
+  guint8 *data = shmat(id, NULL, 0);
+  if (data == (void *)-1) {
+    shmctl(id, IPC_RMID, NULL);
+    return NULL;
+  }
+  xcb_shm_seg_t seg = xcb_generate_id(c);
+  xcb_generic_error_t *err =
+      xcb_request_check(c, xcb_shm_attach_checked(c, seg, id, 1));
+  // the segment goes away once both of us have detached
+  shmctl(id, IPC_RMID, NULL);
+  if (err != NULL) {
+    // most likely a remote connection
+    free(err);
+    shmdt(data);
+    return NULL;
+  }
+  shm_release(t);
+  t->shm_seg = seg;
+  t->shm_data = data;
+  return cairo_image_surface_create_for_data(data, format, width, size,
+                                             stride);
+}
+
+// (re)creates t's back buffer if it's narrower than width. it grows in
+// doubling steps so items coming one at a time don't reallocate each time.
+// returns TRUE if the buffer is new and needs to be drawn from scratch
+static gboolean ensure_back_buffer(TrayWindow *t, int width) {
+  if (t->surface != NULL && width <= t->buf_width) return FALSE;
+  int new_width = MAX(width, MAX(2 * t->buf_width, size));
+  if (t->surface != NULL) {
+    cairo_destroy(t->cr);
+    cairo_surface_destroy(t->surface);
+  }
+  t->surface = NULL;
+  if (use_shm && (t->surface = shm_create_buffer(t, new_width)) == NULL) {
+    warnx("Couldn't set up MIT-SHM, drawing into a pixmap");
+    use_shm = FALSE;
+  }
+  if (t->surface == NULL) {
+    // windows that already have a segment keep it until they grow
+    shm_release(t);
+    if (t->buf_pix != XCB_NONE) xcb_free_pixmap(c, t->buf_pix);
+    t->buf_pix = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, t->buf_pix, t->win, new_width, size);
+    t->surface =
+        cairo_xcb_surface_create(c, t->buf_pix, visual, new_width, size);
+    if (use_atlas) atlas_bind_buffer(t);
+  }
+  t->buf_width = new_width;
+  t->cr = cairo_create(t->surface);
+  cairo_reset_surface(t->cr);
+  cairo_surface_flush(t->surface);
+  return TRUE;
+}
+// copy part of t's back buffer to its window
+static void present(TrayWindow *t, int x, int y, int width, int height) {
+  if (t->shm_data == NULL) {
+    xcb_copy_area(c, t->buf_pix, t->win, gc, x, y, x, y, width, height);
+    return;
+  }
+  // ask for a completion event, we can't draw into the segment again before
+  // the server has read it
+  xcb_shm_put_image(c, t->win, gc, t->buf_width, size, x, y, width, height,
+                    x, y, depth, XCB_IMAGE_FORMAT_Z_PIXMAP, 1, t->shm_seg, 0);
+  t->shm_busy = TRUE;
+}
+// what each slot of a window shows right now. a frame only clears and
+// repaints the slots whose content changed since the last one
+typedef struct SlotState {
+  gboolean valid;  // FALSE until something has been painted there
+  gboolean placeholder;
+  gchar *path;
+  guint64 serial;
+} SlotState;
+static guint64 slots_painted = 0, slots_skipped = 0;
+
+void tray_damage_all() {
+  for (guint i = 0; i < trays->len; i++)
+    ((TrayWindow *)g_ptr_array_index(trays, i))->damage_all = TRUE;
+  tray_queue_redraw();
+}
+
+static gboolean slot_changed(SlotState *s, ItemView *data) {
+  if (!s->valid || s->placeholder != !data->loaded) return TRUE;
+  if (!data->loaded) return FALSE;
+  if (g_strcmp0(s->path, data->icon_path) != 0) return TRUE;
+  if (data->icon_path != NULL) return FALSE;
+  return s->serial != (data->icon_pixmap ? data->icon_pixmap->serial : 0);
+}
+
+static void slot_remember(SlotState *s, ItemView *data) {
+  s->valid = TRUE;
+  s->placeholder = !data->loaded;
+  g_free(s->path);
+  s->path = g_strdup(data->icon_path);
+  s->serial = data->icon_pixmap ? data->icon_pixmap->serial : 0;
+}
+
+static void draw_slot(TrayWindow *t, ItemView *data, int x) {
+  if (use_atlas && t->buf_pict != XCB_NONE) {
+    atlas_draw_slot(t, data, x);
+    return;
+  }
+  cairo_t *cr = t->cr;
+  cairo_save(cr);
+  cairo_rectangle(cr, x, 0, size, size);
+  cairo_clip(cr);
+  cairo_reset_surface(cr);
+  // if icon path is specified
+  if (!data->loaded)
+    draw_placeholder(cr, x);
+  else if (data->icon_path != NULL)
+    draw_image(cr, data->icon_path, x);
+  else if (data->icon_pixmap != NULL)
+    draw_pixmap(cr, data->icon_pixmap, x);
+  cairo_restore(cr);
+}
+
+// the items being drawn: the newest snapshot the D-Bus thread published
+static TraySnapshot *shown = NULL;
+static atomic_bool snapshot_wake = false;
+
+static gboolean take_snapshots(gpointer user_data) {
+  // cleared first, so a snapshot pushed from here on schedules another call
+  atomic_store(&snapshot_wake, false);
+  TraySnapshot *snap;
+  gboolean changed = FALSE, damage = FALSE;
+  // only the newest one is worth drawing
+  while ((snap = snapshot_pop()) != NULL) {
+    damage |= snap->damage_all;
+    if (shown != NULL) snapshot_free(shown);
+    shown = snap;
+    changed = TRUE;
+  }
+  if (damage)
+    tray_damage_all();
+  else if (changed)
+    tray_queue_redraw();
+  return G_SOURCE_REMOVE;
+}
+
+// called from the D-Bus thread once it has published a snapshot
+void tray_snapshot_ready() {
+  if (!atomic_exchange(&snapshot_wake, true))
+    g_idle_add(take_snapshots, NULL);
+}
+
+static void draw_tray_window(TrayWindow *t, guint n) {
+  // if new width (num of items) !=  current width (t->dim.width), resize
+  // window
+  if (n * size != t->dim.width) resize_window(t, n);
+  if (ensure_back_buffer(t, n * size)) t->damage_all = TRUE;
+  if (t->damage == NULL) t->damage = cairo_region_create();
+  if (t->slot_state == NULL)
+    t->slot_state = g_array_new(FALSE, TRUE, sizeof(SlotState));
+  // slots past the end are gone, new ones are zeroed and so not valid yet
+  for (guint i = n; i < t->slot_state->len; i++)
+    g_free(g_array_index(t->slot_state, SlotState, i).path);
+  g_array_set_size(t->slot_state, n);
+
+  for (guint i = 0; i < n; i++) {
+    ItemView *data = shown->items[i];
+    SlotState *s = &g_array_index(t->slot_state, SlotState, i);
+    if (!t->damage_all && !slot_changed(s, data)) {
+      slots_skipped++;
+      continue;
+    }
+    draw_slot(t, data, i * size);
+    slot_remember(s, data);
+    slots_painted++;
+    cairo_rectangle_int_t rect = {i * size, 0, size, size};
+    cairo_region_union_rectangle(t->damage, &rect);
+  }
+  t->damage_all = FALSE;
+}
+
 // void draw_tray(GList *list) {
 void draw_tray() {
   // rgba_t bg = {0x00,0x00,0x00,0xaa};
-  cairo_reset_surface(cr);
-  // iterate through list of data
-  int i = 0;
-  for (GList *l = list; l != NULL; l = l->next, i++) {
-    // if icon path is specified
-    if (((ItemData *)l->data)->icon_path != NULL)
-      draw_image(cr, ((ItemData *)l->data)->icon_path, i * size);
-    // else if (((ItemData *) l->data)->icon_pixmap != NULL)
-    //	draw_pixmap(cr, ((ItemData *) l->data)->icon_pixmap, i*size);
-  }
-  // if new width (num of items) !=  current width (win_dim->width), resize
-  // window
-  guint w = g_list_length(list);
-  if (w * size != win_dim.width) resize_window(w);
+  // every window draws from the same items and the same decoded surfaces
+  guint n = shown ? shown->n : 0;
+  for (guint i = 0; i < trays->len; i++)
+    draw_tray_window(g_ptr_array_index(trays, i), n);
+}
+
+static TrayWindow *tray_for_window(xcb_window_t win) {
+  for (guint i = 0; i < trays->len; i++) {
+    TrayWindow *t = g_ptr_array_index(trays, i);
+    if (t->win == win) return t;
+  }
+  return NULL;
+}
+
+static gboolean any_shm_busy() {
+  for (guint i = 0; i < trays->len; i++)
+    if (((TrayWindow *)g_ptr_array_index(trays, i))->shm_busy) return TRUE;
+  return FALSE;
+}
+
+// signal handlers only ask for a redraw, the paint itself runs from an idle
+// source (after the pending D-Bus traffic has been dispatched) and at most
+// once per frame interval
+#define FRAME_INTERVAL 16  // ms
+static guint frame_id = 0;
+static gint64 last_frame = 0;
+// requests merged into an already scheduled frame, and frames pushed back
+// to keep to the interval
+static guint64 frames_painted = 0, frames_coalesced = 0, frames_deferred = 0;
+// X events, and the batches they were handled in, see callback()
+static guint64 events_handled = 0, event_batches = 0, exposes_merged = 0;
+
+static gboolean run_frame(gpointer user_data) {
+  frame_id = 0;
+  if (any_shm_busy()) {
+    // picked up again when the last ShmCompletion event arrives
+    frames_deferred++;
+    frame_waiting = TRUE;
+    return G_SOURCE_REMOVE;
+  }
+  last_frame = g_get_monotonic_time();
+  frames_painted++;
+  draw_tray();
+  // everything the frame changed goes to each window in one copy
+  for (guint i = 0; i < trays->len; i++) {
+    TrayWindow *t = g_ptr_array_index(trays, i);
+    cairo_surface_flush(t->surface);
+    if (cairo_region_is_empty(t->damage)) continue;
+    cairo_rectangle_int_t r;
+    cairo_region_get_extents(t->damage, &r);
+    present(t, r.x, r.y, r.width, r.height);
+    cairo_region_destroy(t->damage);
+    t->damage = cairo_region_create();
+  }
+  xcb_flush(c);
+  return G_SOURCE_REMOVE;
+}
+
+void tray_queue_redraw() {
+  if (frame_id) {
+    frames_coalesced++;
+    return;
+  }
+  gint64 since = (g_get_monotonic_time() - last_frame) / 1000;
+  if (since >= FRAME_INTERVAL) {
+    frame_id = g_idle_add(run_frame, NULL);
+  } else {
+    frames_deferred++;
+    frame_id = g_timeout_add(FRAME_INTERVAL - since, run_frame, NULL);
+  }
+}
+
+void frame_report() {
+  printf("frames: %" G_GUINT64_FORMAT " painted, %" G_GUINT64_FORMAT
+         " coalesced, %" G_GUINT64_FORMAT " deferred, %u windows\n",
+         frames_painted, frames_coalesced, frames_deferred, trays->len);
+  printf("slots: %" G_GUINT64_FORMAT " repainted, %" G_GUINT64_FORMAT
+         " unchanged\n",
+         slots_painted, slots_skipped);
+  if (use_atlas)
+    printf("atlas: %u/%d cells, %" G_GUINT64_FORMAT " uploads, %"
+           G_GUINT64_FORMAT " composites, %" G_GUINT64_FORMAT
+           " drawn without it, %" G_GUINT64_FORMAT " cells reclaimed\n",
+           atlas_cells, ATLAS_COLS * ATLAS_ROWS, atlas_uploads,
+           atlas_composites, atlas_misses, atlas_reclaims);
+  printf("events: %" G_GUINT64_FORMAT " in %" G_GUINT64_FORMAT
+         " batches, %" G_GUINT64_FORMAT " exposes merged\n",
+         events_handled, event_batches, exposes_merged);
 }
 // void init_window(win_data *data) {
 void init_window() {
+  gint64 startup = phase_start = g_get_monotonic_time();
   c = xcb_connect(NULL, &screen_num);
+  // have the extension queries answered while we do other things
+  xcb_prefetch_extension_data(c, &xcb_randr_id);
+  xcb_prefetch_extension_data(c, &xcb_render_id);
+  xcb_prefetch_extension_data(c, &xcb_shm_id);
   xcb_screen_t *s = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
   uint32_t vals[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
   xcb_change_window_attributes(c, s->root, XCB_CW_EVENT_MASK, vals);
-  xcb_rectangle_t mon_dim = {0, 0, 0, 0};
-  mon_select(s, &mon_dim, "HDMI3");
-  win_dim = (xcb_rectangle_t){mon_dim.x, mon_dim.y, 24, 24};
-
-  w = main_win_init(s);
-
-  /*
-  xcb_pixmap_t buf_pix = xcb_generate_id(c);
-  if(xcb_request_check(c, xcb_create_pixmap_checked(c, depth, buf_pix, w,
-  win_dim.width, win_dim.height))) errx(1, "Failed to create pixmap");
+  phase_done("connect");
+  screen = s;
+  // one window per output, or just one on the primary
+  const char *outputs = g_getenv("SNI_TRAY_OUTPUT");
+  output_names = g_strsplit(outputs ? outputs : "", ",", -1);
+  trays = g_ptr_array_new();
+  guint n_outputs = MAX(g_strv_length(output_names), 1);
+  for (guint i = 0; i < n_outputs; i++) {
+    TrayWindow *t = g_new0(TrayWindow, 1);
+    // an empty name means the primary too
+    if (output_names[i] != NULL && *output_names[i] != '\0')
+      t->output = output_names[i];
+    xcb_rectangle_t mon_dim = {0, 0, 0, 0};
+    if (!mon_select(s, &mon_dim, t->output))
+      errx(1, "No monitor to put the tray on");
+    t->dim = (xcb_rectangle_t){mon_dim.x, mon_dim.y, 24, 24};
+    t->damage_all = TRUE;
+    g_ptr_array_add(trays, t);
+  }
+  // follow docking, undocking and mode changes
+  const xcb_query_extension_reply_t *randr =
+      xcb_get_extension_data(c, &xcb_randr_id);
+  randr_event_base = randr->first_event;
+  xcb_randr_select_input(c, s->root,
+                         XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                             XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+                             XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+  phase_done("monitor selection");
 
+  for (guint i = 0; i < trays->len; i++)
+    main_win_init(s, g_ptr_array_index(trays, i));
+  phase_done("window setup");
 
-  xcb_visualtype_t *visual_tray = xcb_aux_find_visual_by_id(s,
-  s->root_visual); uint8_t depth = xcb_aux_get_depth_of_visual(s,
-  visual->visual_id); cairo_surface_t *buf = cairo_xcb_surface_create(c,
-  buf_pix, visual, win_dim.width, win_dim.height);
-  */
-  surface =
-      cairo_xcb_surface_create(c, w, visual, win_dim.width, win_dim.height);
-  // TODO implement buffer surface
-  // cairo_t *cr_buf = cairo_create(buf);
-  cr = cairo_create(surface);
-
-  // xcb_pixmap_t pixmap = xcb_generate_id(c);
-  // xcb_gcontext_t gc = xcb_generate_id(c);
+  // all windows have the same depth, so they can share a gc
+  TrayWindow *first = g_ptr_array_index(trays, 0);
+  uint32_t gc_vals[] = {0};
+  gc = xcb_generate_id(c);
+  xcb_create_gc(c, gc, first->win, XCB_GC_GRAPHICS_EXPOSURES, gc_vals);
   bg = (rgba_t){0x00, 0x00, 0x00, 0xaa};
-  cairo_reset_surface(cr);
+  use_shm = g_strcmp0(g_getenv("SNI_TRAY_SHM"), "1") == 0;
+  if (use_shm && !shm_available()) {
+    warnx("MIT-SHM isn't available, drawing into a pixmap");
+    use_shm = FALSE;
+  }
+  // the atlas only pays off when the buffers live on the server, and its
+  // cells are in device pixels
+  if (!use_shm && scale == 1 &&
+      g_strcmp0(g_getenv("SNI_TRAY_ATLAS"), "0") != 0)
+    use_atlas = atlas_init();
+  for (guint i = 0; i < trays->len; i++) {
+    TrayWindow *t = g_ptr_array_index(trays, i);
+    ensure_back_buffer(t, t->dim.width);
+  }
+  printf("backend: %s%s, %u windows\n", use_shm ? "mit-shm" : "pixmap",
+         use_atlas ? " + xrender atlas" : "", trays->len);
+  phase_done("backend setup");
+  printf("startup: %.2fms total\n",
+         (g_get_monotonic_time() - startup) / 1000.0);
 
   // draw_image(cr,
   // "/usr/share/icons/Papirus-Dark/24x24/panel/nm-signal-50.svg", 0);
 }
 
-gboolean callback(xcb_generic_event_t *event, gpointer user_data) {
-  if (event == NULL) {
-    printf("ruh roh\n");
-    return FALSE;
+// find each window's monitor again and move the window there. everything
+// else (items, caches, the back buffers) stays as it is
+static gboolean reconfigure(gpointer user_data) {
+  reconfigure_id = 0;
+  for (guint i = 0; i < trays->len; i++) {
+    TrayWindow *t = g_ptr_array_index(trays, i);
+    xcb_rectangle_t mon_dim = {0, 0, 0, 0};
+    if (!mon_select(screen, &mon_dim, t->output)) continue;
+    if (mon_dim.x == t->dim.x && mon_dim.y == t->dim.y) continue;
+    printf("moving tray to %d, %d\n", mon_dim.x, mon_dim.y);
+    t->dim.x = mon_dim.x;
+    t->dim.y = mon_dim.y;
+    uint32_t values[] = {(uint32_t)t->dim.x, (uint32_t)t->dim.y};
+    xcb_configure_window(c, t->win, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y,
+                         values);
+    update_strut(t);
+  }
+  xcb_flush(c);
+  return G_SOURCE_REMOVE;
+}
+
+// the xcb source hands us one event per call, in order. exposes only add to
+// the window's exposed region, and an idle (lower priority than the source,
+// so it runs once no more events are ready) copies each merged region from
+// the back buffer
+static guint batch_id = 0;
+
+static gboolean end_batch(gpointer user_data) {
+  batch_id = 0;
+  event_batches++;
+  for (guint i = 0; i < trays->len; i++) {
+    TrayWindow *t = g_ptr_array_index(trays, i);
+    if (t->exposed == NULL || cairo_region_is_empty(t->exposed)) continue;
+    // the back buffer still holds the last frame, no need to draw again
+    cairo_surface_flush(t->surface);
+    for (int j = 0; j < cairo_region_num_rectangles(t->exposed); j++) {
+      cairo_rectangle_int_t r;
+      cairo_region_get_rectangle(t->exposed, j, &r);
+      present(t, r.x, r.y, r.width, r.height);
+    }
+    cairo_region_destroy(t->exposed);
+    t->exposed = cairo_region_create();
+  }
+  xcb_flush(c);
+  return G_SOURCE_REMOVE;
+}
+
+static void handle_event(xcb_generic_event_t *event) {
+  events_handled++;
+  uint8_t type = event->response_type & ~0x80;
+  // windows may keep their segments after use_shm was turned off
+  if (shm_event_base != 0 && type == shm_event_base + XCB_SHM_COMPLETION) {
+    xcb_shm_completion_event_t *ce = (xcb_shm_completion_event_t *)event;
+    TrayWindow *t = tray_for_window(ce->drawable);
+    if (t != NULL) t->shm_busy = FALSE;
+    if (frame_waiting && !any_shm_busy()) {
+      frame_waiting = FALSE;
+      tray_queue_redraw();
+    }
+    return;
+  }
+  if (type == randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+      type == randr_event_base + XCB_RANDR_NOTIFY) {
+    // changes come in bursts, look at the result once they're over
+    if (reconfigure_id == 0) reconfigure_id = g_idle_add(reconfigure, NULL);
+    return;
   }
-  switch (event->response_type & ~0x80) {
+  switch (type) {
     case XCB_BUTTON_PRESS: {
       xcb_button_press_event_t *bp = (xcb_button_press_event_t *)event;
       /*
@@ -374,13 +1160,35 @@ gboolean callback(xcb_generic_event_t *event, gpointer user_data) {
       "delta" of scroll, use time/amount? default:
       }
       */
-      call_method(bp->detail, bp->event_x, bp->event_y, bp->root_x,
-                  bp->event_y);
+      // every window shows the same items in the same slots
+      guint slot = bp->event_x / size;
+      if (shown == NULL || slot >= shown->n) break;
+      call_method(bp->detail, shown->items[slot], bp->root_x, bp->root_y);
+      break;
+    }
+    case XCB_EXPOSE: {
+      xcb_expose_event_t *ex = (xcb_expose_event_t *)event;
+      TrayWindow *t = tray_for_window(ex->window);
+      if (t == NULL) break;
+      if (t->exposed == NULL) t->exposed = cairo_region_create();
+      cairo_rectangle_int_t r = {ex->x, ex->y, ex->width, ex->height};
+      cairo_region_union_rectangle(t->exposed, &r);
+      exposes_merged++;
+      break;
     }
   }
-  xcb_flush(c);
+}
+
+gboolean callback(xcb_generic_event_t *event, gpointer user_data) {
+  if (event == NULL) {
+    printf("ruh roh\n");
+    return FALSE;
+  }
+  handle_event(event);
+  if (batch_id == 0) batch_id = g_idle_add(end_batch, NULL);
   return TRUE;
 }
+
 /*
 int main() {
         //win_data data;
@@ -15,4 +15,10 @@ typedef struct {
 enum click_type { PRIMARY = 1, SECONDARY, CONTEXT, UNUSED, SCROLL };
 gboolean callback(xcb_generic_event_t *event, gpointer user_data);
 void draw_tray();
+void tray_queue_redraw();
+void tray_damage_all();
+// thread safe, for the D-Bus thread
+void tray_snapshot_ready();
+void frame_report();
 void init_window();
+void surface_cache_report();
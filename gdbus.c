@@ -1,16 +1,23 @@
 #include "gdbus.h"
 
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #include "draw.h"
 static void on_watch_sig_changed(GDBusProxy *p, gchar *sender_name,
                                  gchar *signal_name, GVariant *param,
                                  gpointer user_data);
-static void on_item_sig_changed(GDBusProxy *p, gchar *sender_name,
-                                gchar *signal_name, GVariant *param,
-                                gpointer user_data);
-static void init_item_data(const gchar *name, const gchar *path,
-                           ItemData *data);
+static void on_item_signal(GDBusConnection *c, const gchar *sender,
+                           const gchar *path, const gchar *iface,
+                           const gchar *signal_name, GVariant *param,
+                           gpointer user_data);
+static void add_item(const gchar *item);
+static void remove_item(ItemData *data);
+static void fetch_properties(ItemData *data);
+static void unroute_item(ItemData *data);
+static void parse_item_name(const gchar *item, gchar **name, gchar **path);
 static void watcher_appeared_handler(GDBusConnection *c, const gchar *name,
                                      const gchar *sender, gpointer user_data);
 static void watcher_vanished_handler(GDBusConnection *c, const gchar *name,
@@ -19,52 +26,380 @@ static void on_name_acquired(GDBusConnection *c, const gchar *name,
                              gpointer user_data);
 static void on_name_lost(GDBusConnection *c, const gchar *name,
                          gpointer user_data);
+static void items_changed();
+static void start_loads();
 
 static gchar host[50] = "org.freedesktop.StatusNotifierHost-";
 static const gchar watcher[] = "org.kde.StatusNotifierWatcher";
 static const gchar watcher_path[] = "/StatusNotifierWatcher";
-// put in ya_bar_t:
-GList *list = NULL;
+// the items in tray order. slots is what layout and hit testing index into,
+// by_name finds an item from its "bus_name/object/path"
+static GPtrArray *slots = NULL;
+static GHashTable *by_name = NULL;
 static gchar *theme = NULL;
 // this will be height or something like that
 static int size = 24;
+// how long we give an item to answer GetAll (ms)
+#define LOAD_TIMEOUT 5000
+// how many items may be loading at once, SNI_TRAY_INFLIGHT overrides it
+static guint max_inflight = 8;
+static guint inflight = 0;
+// items waiting for a free loading slot, in registration order
+static GQueue load_queue = G_QUEUE_INIT;
 
-void call_method(int click_type, int event_x, int event_y, int root_x,
-                 int root_y) {
-  printf("Event %d at (%d, %d), root (%d, %d)\n", click_type, event_x, event_y,
-         root_x, root_y);
-  ItemData *i = g_list_nth_data(list, event_x / size);
-  printf("Interacted with %s\n", i->id);
-  GVariant *res = NULL;
+// D-Bus runs on a thread of its own, with its own main context, so
+// marshalling, property parsing and icon lookups never hold up X events or
+// painting. everything in this file runs there except main(), call_method()
+// and the consumer side of the snapshot queue
+static GMainContext *dbus_ctx = NULL;
+
+// g_timeout_add() and friends would put the source in the render thread's
+// context
+static guint dbus_source_add(GSource *src, GSourceFunc fn, gpointer data) {
+  g_source_set_callback(src, fn, data, NULL);
+  guint id = g_source_attach(src, dbus_ctx);
+  g_source_unref(src);
+  return id;
+}
+
+static void dbus_source_remove(guint id) {
+  GSource *src = g_main_context_find_source_by_id(dbus_ctx, id);
+  if (src != NULL) g_source_destroy(src);
+}
+
+static ItemData *registry_lookup(const gchar *name, const gchar *path) {
+  gchar *key = g_strconcat(name, path, NULL);
+  ItemData *data = g_hash_table_lookup(by_name, key);
+  g_free(key);
+  return data;
+}
+
+static void registry_add(ItemData *data) {
+  data->slot = slots->len;
+  g_ptr_array_add(slots, data);
+  g_hash_table_insert(by_name,
+                      g_strconcat(data->dbus_name, data->object_path, NULL),
+                      data);
+}
+
+// slots are dense because the tray draws items side by side in order, so
+// removal is O(n): the items after the removed one move down by one slot and
+// are renumbered. lookups and adds stay O(1)
+static void registry_remove(ItemData *data) {
+  gchar *key = g_strconcat(data->dbus_name, data->object_path, NULL);
+  g_hash_table_remove(by_name, key);
+  g_free(key);
+  g_ptr_array_remove_index(slots, data->slot);
+  for (guint i = data->slot; i < slots->len; i++)
+    ((ItemData *)g_ptr_array_index(slots, i))->slot = i;
+}
+
+// every string an item owns lives in the item's arena, so the whole item
+// goes away in one step. replaced strings stay in the arena until it has
+// collected enough garbage to be worth compacting
+static const gsize item_strings[] = {
+    G_STRUCT_OFFSET(ItemData, dbus_name),
+    G_STRUCT_OFFSET(ItemData, object_path),
+    G_STRUCT_OFFSET(ItemData, owner),
+    G_STRUCT_OFFSET(ItemData, route_key),
+    G_STRUCT_OFFSET(ItemData, category),
+    G_STRUCT_OFFSET(ItemData, id),
+    G_STRUCT_OFFSET(ItemData, title),
+    G_STRUCT_OFFSET(ItemData, status),
+    G_STRUCT_OFFSET(ItemData, icon_name),
+    G_STRUCT_OFFSET(ItemData, icon_path),
+    G_STRUCT_OFFSET(ItemData, theme_path),
+    G_STRUCT_OFFSET(ItemData, overlay_name),
+    G_STRUCT_OFFSET(ItemData, att_name),
+    G_STRUCT_OFFSET(ItemData, movie_name),
+};
+#define ARENA_CHUNK 256
+// compact once this much of the arena is garbage
+#define ARENA_SLACK 1024
+
+static gsize item_live_strings(ItemData *data) {
+  gsize live = 0;
+  for (guint i = 0; i < G_N_ELEMENTS(item_strings); i++) {
+    gchar *str = G_STRUCT_MEMBER(gchar *, data, item_strings[i]);
+    if (str) live += strlen(str) + 1;
+  }
+  return live;
+}
+
+static void item_compact(ItemData *data) {
+  GStringChunk *strings = g_string_chunk_new(ARENA_CHUNK);
+  for (guint i = 0; i < G_N_ELEMENTS(item_strings); i++) {
+    gchar **str = G_STRUCT_MEMBER_P(data, item_strings[i]);
+    if (*str) *str = g_string_chunk_insert(strings, *str);
+  }
+  g_string_chunk_free(data->strings);
+  data->strings = strings;
+  data->arena_used = item_live_strings(data);
+}
+
+static void item_set(ItemData *data, gchar **field, const gchar *value) {
+  if (g_strcmp0(*field, value) == 0) return;
+  if (value == NULL) {
+    *field = NULL;
+    return;
+  }
+  *field = g_string_chunk_insert(data->strings, value);
+  data->arena_used += strlen(value) + 1;
+  if (data->arena_used > 2 * item_live_strings(data) + ARENA_SLACK)
+    item_compact(data);
+}
+
+static gsize pixmap_bytes(const Pixmap *px) {
+  return px ? sizeof(Pixmap) + g_variant_get_size(px->bytes) : 0;
+}
+
+static gsize item_bytes(ItemData *data) {
+  return sizeof(ItemData) + data->arena_used +
+         pixmap_bytes(data->icon_pixmap) + pixmap_bytes(data->att_pixmap) +
+         (data->menu ? g_variant_get_size(data->menu) : 0);
+}
+
+void item_memory_report() {
+  gsize total = 0;
+  printf("item memory:\n");
+  for (guint n = 0; n < slots->len; n++) {
+    ItemData *i = g_ptr_array_index(slots, n);
+    gsize bytes = item_bytes(i);
+    total += bytes;
+    printf("  %s (%s): %zu bytes, %zu in strings (%zu live)\n",
+           i->id ? i->id : "?", i->dbus_name, bytes, i->arena_used,
+           item_live_strings(i));
+  }
+  printf("  %u items, %zu bytes\n", slots->len, total);
+}
+
+// how long an item gets to answer a property refresh (ms)
+#define REFRESH_TIMEOUT 1000
+// consecutive failures before an item is considered degraded
+#define DEGRADE_AFTER 3
+// backoff between probes of a degraded item (ms)
+#define RETRY_MIN 1000
+#define RETRY_MAX 60000
+
+static gboolean probe_item(gpointer user_data) {
+  ItemData *data = user_data;
+  data->health.retry_id = 0;
+  printf("Probing %s\n", data->dbus_name);
+  if (data->proxy != NULL) {
+    fetch_properties(data);
+  } else {
+    // never got a proxy, load it again from the start
+    g_queue_push_tail(&load_queue, data);
+    start_loads();
+  }
+  return G_SOURCE_REMOVE;
+}
+
+static void health_ok(ItemData *data) {
+  ItemHealth *h = &data->health;
+  h->failures = 0;
+  h->backoff = 0;
+  if (h->retry_id) dbus_source_remove(h->retry_id);
+  h->retry_id = 0;
+  if (!h->degraded) return;
+  printf("%s is responding again\n", data->dbus_name);
+  h->degraded = FALSE;
+}
+
+// once an item has failed too often in a row we stop talking to it: the tray
+// keeps showing its last known state, and a single probe now and then, with
+// exponential backoff, finds out when it has come back
+static void health_fail(ItemData *data, const GError *error) {
+  ItemHealth *h = &data->health;
+  if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT))
+    h->timeouts++;
+  else
+    h->errors++;
+  h->failures++;
+  if (!h->degraded) {
+    if (h->failures < DEGRADE_AFTER) return;
+    printf("%s is not responding, using cached state\n", data->dbus_name);
+    h->degraded = TRUE;
+    h->backoff = RETRY_MIN;
+  } else {
+    h->backoff = MIN(h->backoff * 2, RETRY_MAX);
+  }
+  if (h->retry_id == 0)
+    h->retry_id =
+        dbus_source_add(g_timeout_source_new(h->backoff), probe_item, data);
+}
+
+// an item that failed before we had anything to show of it has no last
+// known state to serve, so it's retried with backoff right away instead of
+// after DEGRADE_AFTER failures
+static void retry_if_empty(ItemData *data) {
+  ItemHealth *h = &data->health;
+  if (h->retry_id != 0 ||
+      (data->proxy != NULL &&
+       (data->icon_path != NULL || data->icon_pixmap != NULL)))
+    return;
+  h->backoff = h->backoff ? MIN(h->backoff * 2, RETRY_MAX) : RETRY_MIN;
+  h->retry_id =
+      dbus_source_add(g_timeout_source_new(h->backoff), probe_item, data);
+}
+
+void item_health_report() {
+  printf("item health:\n");
+  for (guint n = 0; n < slots->len; n++) {
+    ItemData *i = g_ptr_array_index(slots, n);
+    const ItemHealth *h = &i->health;
+    printf("  %s (%s): %s, %u timeouts, %u errors", i->id ? i->id : "?",
+           i->dbus_name, h->degraded ? "degraded" : "ok", h->timeouts,
+           h->errors);
+    if (h->degraded) printf(", next probe in %ums", h->backoff);
+    printf("\n");
+  }
+}
+
+// how long an item gets to react to a click (ms)
+#define CLICK_TIMEOUT 2000
+
+typedef struct ClickCall {
+  ItemData *item;
+  const gchar *method;
+  gint64 start;
+} ClickCall;
+
+static void record_click(LatencyHist *h, gint64 us) {
+  guint b = g_bit_storage(us > 0 ? us : 0);
+  if (b >= LATENCY_BUCKETS) b = LATENCY_BUCKETS - 1;
+  h->buckets[b]++;
+  h->count++;
+}
+
+// upper bound (in us) of the bucket the p-th percentile falls in
+static gint64 latency_percentile(const LatencyHist *h, guint p) {
+  guint64 want = ((guint64)h->count * p + 99) / 100, seen = 0;
+  for (guint b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= want) return (gint64)1 << b;
+  }
+  return (gint64)1 << (LATENCY_BUCKETS - 1);
+}
+
+static void on_click_reply(GObject *source, GAsyncResult *res,
+                           gpointer user_data) {
+  ClickCall *call = user_data;
   GError *error = NULL;
+  GVariant *reply =
+      g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &error);
+  if (reply) {
+    g_variant_unref(reply);
+    health_ok(call->item);
+  } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    // the item is gone
+    g_error_free(error);
+    g_free(call);
+    return;
+  } else {
+    ItemData *i = call->item;
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT))
+      i->clicks.timeouts++;
+    else
+      i->clicks.errors++;
+    fprintf(stderr, "call_method: %s on %s: %s\n", call->method, i->dbus_name,
+            error->message);
+    health_fail(i, error);
+    g_error_free(error);
+  }
+  record_click(&call->item->clicks, g_get_monotonic_time() - call->start);
+  g_free(call);
+}
+
+typedef struct ClickRequest {
+  int click_type;
+  gchar *dbus_name;
+  gchar *object_path;
+  int root_x, root_y;
+  gint64 time;  // when the render thread saw the click
+} ClickRequest;
+
+static void click_request_free(gpointer user_data) {
+  ClickRequest *req = user_data;
+  g_free(req->dbus_name);
+  g_free(req->object_path);
+  g_free(req);
+}
+
+static gboolean send_click(gpointer user_data) {
+  ClickRequest *req = user_data;
+  int root_x = req->root_x, root_y = req->root_y;
+  ItemData *i = registry_lookup(req->dbus_name, req->object_path);
+  if (i == NULL) {
+    printf("%s is gone, ignoring click\n", req->dbus_name);
+    return G_SOURCE_REMOVE;
+  }
+  if (i->proxy == NULL) {
+    printf("Item is still loading\n");
+    return G_SOURCE_REMOVE;
+  }
+  if (i->health.degraded) {
+    printf("%s is not responding, ignoring click\n", i->dbus_name);
+    return G_SOURCE_REMOVE;
+  }
+  printf("Interacted with %s\n", i->id);
+  const gchar *method;
   // find specific application
   // call org.kde.StatusNotifierItem.*
-  switch (click_type) {
+  switch (req->click_type) {
     case PRIMARY:
-      res = g_dbus_proxy_call_sync(i->proxy,
-                                   "org.kde.StatusNotifierItem.Activate",
-                                   g_variant_new("(ii)", root_x, root_y),
-                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+      method = "org.kde.StatusNotifierItem.Activate";
       break;
     case SECONDARY:
-      res = g_dbus_proxy_call_sync(
-          i->proxy, "org.kde.StatusNotifierItem.SecondaryActivate",
-          g_variant_new("(ii)", root_x, root_y), G_DBUS_CALL_FLAGS_NONE, -1,
-          NULL, &error);
+      method = "org.kde.StatusNotifierItem.SecondaryActivate";
       break;
     case CONTEXT:
-      res = g_dbus_proxy_call_sync(i->proxy,
-                                   "org.kde.StatusNotifierItem.ContextMenu",
-                                   g_variant_new("(ii)", root_x, root_y),
-                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+      method = "org.kde.StatusNotifierItem.ContextMenu";
       break;
     case SCROLL:
     default:
       printf("lel\n");
+      return G_SOURCE_REMOVE;
   }
 
-  if (error) {
-    fprintf(stderr, "call_method: error: %s\n", error->message);
+  // never wait for the reply here, a hung item would take the whole tray
+  // down with it
+  ClickCall *call = g_new(ClickCall, 1);
+  call->item = i;
+  call->method = method;
+  call->start = req->time;
+  g_dbus_proxy_call(i->proxy, method, g_variant_new("(ii)", root_x, root_y),
+                    G_DBUS_CALL_FLAGS_NONE, CLICK_TIMEOUT, i->cancel,
+                    on_click_reply, call);
+  return G_SOURCE_REMOVE;
+}
+
+void call_method(int click_type, const ItemView *view, int root_x,
+                 int root_y) {
+  printf("Event %d on %s, root (%d, %d)\n", click_type, view->dbus_name,
+         root_x, root_y);
+  ClickRequest *req = g_new(ClickRequest, 1);
+  *req = (ClickRequest){click_type,
+                        g_strdup(view->dbus_name),
+                        g_strdup(view->object_path),
+                        root_x,
+                        root_y,
+                        g_get_monotonic_time()};
+  g_main_context_invoke_full(dbus_ctx, G_PRIORITY_DEFAULT, send_click, req,
+                             click_request_free);
+}
+
+void click_latency_report() {
+  printf("click latency (click to reply):\n");
+  for (guint n = 0; n < slots->len; n++) {
+    ItemData *i = g_ptr_array_index(slots, n);
+    const LatencyHist *h = &i->clicks;
+    if (h->count == 0) continue;
+    printf("  %s (%s): %u clicks, p50 <%.1fms, p99 <%.1fms, %u timeouts, "
+           "%u errors\n",
+           i->id ? i->id : "?", i->dbus_name, h->count,
+           latency_percentile(h, 50) / 1000.0,
+           latency_percentile(h, 99) / 1000.0, h->timeouts, h->errors);
   }
 }
 static void print_data(ItemData *data) {
@@ -80,184 +415,542 @@ static void print_data(ItemData *data) {
   printf("att_name: %s\n", data->att_name);
   printf("movie_name: %s\n", data->movie_name);
   printf("ItemIsMenu: %s\n", data->ismenu ? "true" : "false");
-  printf("Menu: %s\n", g_variant_get_string(data->menu, NULL));
+  printf("Menu: %s\n", data->menu ? g_variant_get_string(data->menu, NULL)
+                                  : "(null)");
 }
 static void on_watch_sig_changed(GDBusProxy *p, gchar *sender_name,
                                  gchar *signal_name, GVariant *param,
                                  gpointer user_data) {
   const gchar *item;
-  gchar *just_name;
   if (g_strcmp0(signal_name, "StatusNotifierItemRegistered") == 0) {
     g_variant_get(param, "(&s)", &item);
-    just_name = g_strndup(item, g_strstr_len(item, -1, "/") - item);
     printf("Item %s has been registered\n", item);
-    // extract param and add it to the list
-    ItemData *data = g_new0(ItemData, 1);
-    // extract object path from item name
-    init_item_data(just_name, g_strstr_len(item, -1, "/"), data);
-    list = g_list_prepend(list, data);
+    add_item(item);
 
   } else if (g_strcmp0(signal_name, "StatusNotifierItemUnregistered") == 0) {
     g_variant_get(param, "(&s)", &item);
-    just_name = g_strndup(item, g_strstr_len(item, -1, "/") - item);
+    gchar *name, *path;
+    parse_item_name(item, &name, &path);
     printf("Item %s has been unregistered\n", item);
-    // remove param from the list
-    GList *l = list;
-    while (l != NULL) {
-      GList *next = l->next;
-      ItemData *d = l->data;
-      if (g_strcmp0(d->dbus_name, just_name) == 0) {
-        list = g_list_remove(user_data, l->data);
-      }
-      l = next;
+    ItemData *d = registry_lookup(name, path);
+    if (d) remove_item(d);
+    g_free(name);
+    g_free(path);
+  }
+  items_changed();
+}
+
+static inline void ensure_icon_path(ItemData *data, gchar *icon,
+                                    gchar **output) {
+  gchar *path = NULL;
+  if (icon != NULL) {
+    path = find_icon(icon, size, theme);
+    if (path) {
+      printf("%s\n", path);
+    } else {
+      printf("No icon found\n");
     }
   }
-  draw_tray();
+  item_set(data, output, path);
+  g_free(path);
 }
+static guint64 pixmap_serial = 0;
 
-static GVariant *get_property(GDBusProxy *p, gchar *prop) {
-  GError *error = NULL;
-  GVariant *val = g_dbus_proxy_call_sync(
-      p, "org.freedesktop.DBus.Properties.Get",
-      g_variant_new("(ss)", "org.kde.StatusNotifierItem", prop),
-      G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
-  if (val != NULL) {
-    GVariant *variant = NULL;
-    g_variant_get(val, "(v)", &variant);
-    g_variant_unref(val);
-    return variant;
-  } else {
-    fprintf(stderr, "get_property: Couldn't get '%s': '%s'\n", prop,
-            error->message);
-    return NULL;
+void pixmap_free(Pixmap *px) {
+  if (px == NULL) return;
+  g_variant_unref(px->bytes);
+  g_free(px);
+}
+
+// pick the a(iiay) entry closest to our slot size. scaling down looks better
+// than scaling up, so being too small counts double
+static Pixmap *pixmap_from_variant(GVariant *var) {
+  GVariantIter iter;
+  GVariant *bytes;
+  gint32 w, h;
+  gint best_dist = G_MAXINT;
+  Pixmap *best = NULL;
+  g_variant_iter_init(&iter, var);
+  while (g_variant_iter_next(&iter, "(ii@ay)", &w, &h, &bytes)) {
+    gsize len;
+    const guchar *data = g_variant_get_fixed_array(bytes, &len, 1);
+    gint dist = w >= size ? w - size : 2 * (size - w);
+    if (w <= 0 || h <= 0 || len < (gsize)w * h * 4 || dist >= best_dist) {
+      g_variant_unref(bytes);
+      continue;
+    }
+    if (best == NULL) best = g_new0(Pixmap, 1);
+    if (best->bytes) g_variant_unref(best->bytes);
+    *best = (Pixmap){w, h, bytes, data, 0};
+    best_dist = dist;
   }
+  return best;
+}
+
+static gboolean pixmap_same(const Pixmap *a, const Pixmap *b) {
+  return a->width == b->width && a->height == b->height &&
+         g_variant_equal(a->bytes, b->bytes);
 }
 
-static gchar *get_property_string(GDBusProxy *p, gchar *prop) {
-  gchar *retstr = NULL;
-  GVariant *variant = get_property(p, prop);
-  if (variant != NULL) {
-    retstr = g_variant_dup_string(variant, NULL);
-    printf("%s: %s\n", prop, retstr);
-    g_variant_unref(variant);
+// replace *output with the best pixmap in var (which may be NULL), consuming
+// the reference to var. every GetAll sends the pixmap again, so an unchanged
+// one keeps its serial, and with it the converted surface, the atlas cell
+// and the slot as drawn
+static inline void apply_prop_pixmap(GVariant *var, const gchar *name,
+                                     Pixmap **output) {
+  Pixmap *px = NULL;
+  if (var != NULL && g_variant_is_of_type(var, G_VARIANT_TYPE("a(iiay)")))
+    px = pixmap_from_variant(var);
+  if (var != NULL) g_variant_unref(var);
+  if (px != NULL && *output != NULL && pixmap_same(px, *output)) {
+    pixmap_free(px);
+    return;
   }
-  return retstr;
+  pixmap_free(*output);
+  *output = px;
+  if (px == NULL) return;
+  px->serial = ++pixmap_serial;
+  printf("%s: %d x %d\n", name, px->width, px->height);
 }
 
-static gboolean get_property_bool(GDBusProxy *p, gchar *prop) {
-  GVariant *variant = get_property(p, prop);
-  if (variant != NULL) {
-    double ret = g_variant_get_boolean(variant);
-    printf("%s: %s\n", prop, ret ? "true" : "false");
-    g_variant_unref(variant);
-    return ret;
-  } else {
-    fprintf(stderr, "get_property_bool: Couldn't get variant\n");
-    return false;
+// handing items to the render thread: whenever something it draws may have
+// changed, the D-Bus thread publishes a snapshot of the whole tray into a
+// single producer, single consumer ring. only we write head and only the
+// render thread writes tail, so neither side ever waits for the other
+#define SNAPSHOT_RING 8  // a power of two, so the counters can wrap
+// how long to wait before trying again when the ring is full (ms)
+#define PUBLISH_RETRY 16
+static TraySnapshot *ring[SNAPSHOT_RING];
+static atomic_uint ring_head = 0, ring_tail = 0;
+static guint publish_id = 0;
+static gboolean publish_damage_all = FALSE;
+static guint64 snapshots_published = 0, snapshots_retried = 0;
+static guint64 views_made = 0, views_shared = 0;
+
+static gboolean snapshot_push(TraySnapshot *snap) {
+  unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+  if (head - tail == SNAPSHOT_RING) return FALSE;
+  ring[head % SNAPSHOT_RING] = snap;
+  atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+  return TRUE;
+}
+
+TraySnapshot *snapshot_pop() {
+  unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ring_head, memory_order_acquire);
+  if (tail == head) return NULL;
+  TraySnapshot *snap = ring[tail % SNAPSHOT_RING];
+  atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+  return snap;
+}
+
+static void item_view_clear(gpointer mem) {
+  ItemView *v = mem;
+  g_free(v->dbus_name);
+  g_free(v->object_path);
+  g_free(v->icon_path);
+  pixmap_free(v->icon_pixmap);
+}
+
+// views are released from both threads, the count is atomic
+static void item_view_unref(ItemView *v) {
+  g_atomic_rc_box_release_full(v, item_view_clear);
+}
+
+void snapshot_free(TraySnapshot *snap) {
+  for (guint i = 0; i < snap->n; i++) item_view_unref(snap->items[i]);
+  g_free(snap->items);
+  g_free(snap);
+}
+
+static gboolean item_view_matches(const ItemView *v, const ItemData *data) {
+  guint64 serial = data->icon_pixmap ? data->icon_pixmap->serial : 0;
+  return v->loaded == data->loaded &&
+         g_strcmp0(v->icon_path, data->icon_path) == 0 &&
+         (v->icon_pixmap ? v->icon_pixmap->serial : 0) == serial;
+}
+
+// a reference to data's view, made anew if anything the tray draws changed
+static ItemView *item_view(ItemData *data) {
+  if (data->view != NULL && item_view_matches(data->view, data)) {
+    views_shared++;
+    return g_atomic_rc_box_acquire(data->view);
+  }
+  if (data->view != NULL) item_view_unref(data->view);
+  ItemView *v = g_atomic_rc_box_new0(ItemView);
+  v->dbus_name = g_strdup(data->dbus_name);
+  v->object_path = g_strdup(data->object_path);
+  v->loaded = data->loaded;
+  v->icon_path = g_strdup(data->icon_path);
+  if (data->icon_pixmap != NULL) {
+    v->icon_pixmap = g_memdup2(data->icon_pixmap, sizeof(Pixmap));
+    g_variant_ref(v->icon_pixmap->bytes);
   }
+  data->view = v;
+  views_made++;
+  return g_atomic_rc_box_acquire(v);
 }
 
-static inline void ensure_icon_path(GDBusProxy *p, gchar *icon,
-                                    gchar **output) {
-  // printf("%s %s\n", icon, *output);
-  // if((icon != NULL) && (*output == NULL)) {
-  if (icon != NULL) {
-    *output = find_icon(icon, size, theme);
-    if (*output) {
-      printf("%s\n", *output);
-    } else {
-      printf("No icon found\n");
-    }
+static gboolean publish(gpointer user_data) {
+  publish_id = 0;
+  TraySnapshot *snap = g_new(TraySnapshot, 1);
+  snap->n = slots->len;
+  snap->items = g_new(ItemView *, slots->len);
+  for (guint i = 0; i < slots->len; i++)
+    snap->items[i] = item_view(g_ptr_array_index(slots, i));
+  snap->damage_all = publish_damage_all;
+  if (!snapshot_push(snap)) {
+    // the render thread is behind, give it whatever is newest by then
+    snapshot_free(snap);
+    snapshots_retried++;
+    publish_id =
+        dbus_source_add(g_timeout_source_new(PUBLISH_RETRY), publish, NULL);
+    return G_SOURCE_REMOVE;
   }
+  publish_damage_all = FALSE;
+  snapshots_published++;
+  tray_snapshot_ready();
+  return G_SOURCE_REMOVE;
+}
+
+// changes come in bursts (a GetAll reply, a handful of signals), publish
+// once they have all been dispatched
+static void items_changed() {
+  if (publish_id == 0)
+    publish_id = dbus_source_add(g_idle_source_new(), publish, NULL);
+}
+
+static void snapshot_report() {
+  printf("snapshots: %" G_GUINT64_FORMAT " published, %" G_GUINT64_FORMAT
+         " retried, %" G_GUINT64_FORMAT " item views made, %" G_GUINT64_FORMAT
+         " shared\n",
+         snapshots_published, snapshots_retried, views_made, views_shared);
+}
+
+// all item signals arrive through a single match rule on the bus. they are
+// routed to the item by "sender path" (the sender is always the unique
+// name), and to the handler by the quark of the signal name
+typedef void (*ItemSignalHandler)(ItemData *data, GVariant *param);
+static GHashTable *routes = NULL;
+// unique name -> GPtrArray of the items it serves, so a vanished connection
+// finds its items without looking at every slot
+static GHashTable *by_owner = NULL;
+static GHashTable *signal_handlers = NULL;
+
+static gchar *route_key(const gchar *sender, const gchar *path) {
+  return g_strconcat(sender, " ", path, NULL);
+}
+
+// the title, icons and tooltip only announce that they changed
+static void on_item_changed(ItemData *data, GVariant *param) {
+  // a degraded item is served from its cached state until a probe succeeds
+  if (!data->health.degraded) fetch_properties(data);
 }
-static inline void apply_cached_prop_pixmap(GDBusProxy *p, const gchar *name,
-                                            gpointer output) {
-  GVariant *var = g_dbus_proxy_get_cached_property(p, name);
-  Pixmap *pix = g_new0(Pixmap, 1);
-  // gint32 w, h;
-  if (var != NULL) {
-    GVariantIter *iter;
-    g_variant_get(var, "a(iiay)", &iter);
-    while (g_variant_iter_loop(iter, "(iiay)", &(pix->width), &(pix->height),
-                               pix->pixmap))
-      printf("%s: %d x %d\n", name, pix->width, pix->height);
-    g_variant_iter_free(iter);
-    g_variant_unref(var);
+
+// NewStatus carries the new value, no need to ask for it
+static void on_new_status(ItemData *data, GVariant *param) {
+  if (!g_variant_is_of_type(param, G_VARIANT_TYPE("(s)"))) {
+    on_item_changed(data, param);
     return;
   }
-  output = NULL;
+  const gchar *status;
+  g_variant_get(param, "(&s)", &status);
+  item_set(data, &data->status, status);
+  printf("New status: %s\n", data->status);
+  items_changed();
 }
 
-static void on_item_sig_changed(GDBusProxy *p, gchar *sender_name,
-                                gchar *signal_name, GVariant *param,
-                                gpointer user_data) {
-  GVariant *item = NULL;
-  ItemData *data = user_data;
-  // const gchar *prop;
-  printf("Item %s emitted signal %s\n", sender_name, signal_name);
-  if (g_strcmp0(signal_name, "NewTitle") == 0) {
-    data->title = get_property_string(p, "Title");
-    printf("New title: %s\n", data->title);
-  } else if (g_strcmp0(signal_name, "NewIcon") == 0) {
-    if ((data->icon_name = get_property_string(p, "IconName")) != NULL)
-      ensure_icon_path(p, data->icon_name, &(data->icon_path));
-    apply_cached_prop_pixmap(p, "IconPixmap", &(data->icon_pixmap));
-    printf("New icon name: %s\n", data->icon_name);
-  } else if (g_strcmp0(signal_name, "NewAttentionIcon") == 0) {
-    // maybe check for pixmap and/or movie too
-    data->att_name = get_property_string(p, "AttentionIconName");
-    printf("New attention icon name: %s\n", data->att_name);
-  } else if (g_strcmp0(signal_name, "NewOverlayIcon") == 0) {
-    // maybe check for pixmap too
-    data->overlay_name = get_property_string(p, "OverlayIconName");
-    printf("New overlay icon name: %s\n", data->overlay_name);
-  } else if (g_strcmp0(signal_name, "NewToolTip") == 0) {
-    gchar *icon_name = NULL;
-    GVariant *icon = NULL;
-    gchar *title = NULL;
-    gchar *text = NULL;
-    GVariant *variant = get_property(p, "ToolTip");
-    g_variant_get(variant, "(s@a(iiay)ss)", &icon_name, &icon, &title, &text);
-    printf("New tooltip: %s, %s, %s\n", icon_name, title, text);
-  } else if (g_strcmp0(signal_name, "NewStatus") == 0) {
-    data->status = get_property_string(p, "Status");
-    printf("New status: %s\n", data->status);
-  }
-  g_free(item);
-  draw_tray();
-}
-
-static void init_item_data(const gchar *name, const gchar *path,
-                           ItemData *data) {
-  printf("name: %s, path: %s\n", name, path);
-  GDBusProxy *proxy = g_dbus_proxy_new_for_bus_sync(
-      G_BUS_TYPE_SESSION, G_DBUS_PROXY_FLAGS_NONE, NULL, name, path,
-      // G_DBUS_PROXY_FLAGS_GET_INVALIDATED_PROPERTIES, NULL, name, path,
-      "org.kde.StatusNotifierItem", NULL, NULL);
-  g_signal_connect(proxy, "g-signal", G_CALLBACK(on_item_sig_changed), data);
+static void init_signal_routing(GDBusConnection *c) {
+  static const gchar *changed[] = {"NewTitle", "NewIcon", "NewAttentionIcon",
+                                   "NewOverlayIcon", "NewToolTip"};
+  routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  by_owner = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_ptr_array_unref);
+  signal_handlers = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (guint i = 0; i < G_N_ELEMENTS(changed); i++)
+    g_hash_table_insert(
+        signal_handlers,
+        GUINT_TO_POINTER(g_quark_from_static_string(changed[i])),
+        on_item_changed);
+  g_hash_table_insert(signal_handlers,
+                      GUINT_TO_POINTER(g_quark_from_static_string("NewStatus")),
+                      on_new_status);
+  g_dbus_connection_signal_subscribe(c, NULL, "org.kde.StatusNotifierItem",
+                                     NULL, NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+                                     on_item_signal, NULL, NULL);
+}
 
-  data->proxy = proxy;
-  data->dbus_name = g_strdup(name);
+static void route_item(ItemData *data) {
+  gchar *owner = g_dbus_proxy_get_name_owner(data->proxy);
+  if (owner == NULL) return;
+  gchar *key = route_key(owner, data->object_path);
+  item_set(data, &data->owner, owner);
+  item_set(data, &data->route_key, key);
+  g_hash_table_insert(routes, key, data);
+  GPtrArray *served = g_hash_table_lookup(by_owner, owner);
+  if (served == NULL) {
+    served = g_ptr_array_new();
+    g_hash_table_insert(by_owner, g_strdup(owner), served);
+  }
+  g_ptr_array_add(served, data);
+  g_free(owner);
+}
+
+static void unroute_item(ItemData *data) {
+  if (data->route_key == NULL) return;
+  GPtrArray *served = g_hash_table_lookup(by_owner, data->owner);
+  if (served != NULL) {
+    g_ptr_array_remove_fast(served, data);
+    if (served->len == 0) g_hash_table_remove(by_owner, data->owner);
+  }
+  if (g_hash_table_lookup(routes, data->route_key) == data)
+    g_hash_table_remove(routes, data->route_key);
+  data->route_key = NULL;
+}
+
+static void on_item_signal(GDBusConnection *c, const gchar *sender,
+                           const gchar *path, const gchar *iface,
+                           const gchar *signal_name, GVariant *param,
+                           gpointer user_data) {
+  GQuark q = g_quark_try_string(signal_name);
+  ItemSignalHandler handler =
+      q ? g_hash_table_lookup(signal_handlers, GUINT_TO_POINTER(q)) : NULL;
+  if (handler == NULL) return;
+  gchar *key = route_key(sender, path);
+  ItemData *data = g_hash_table_lookup(routes, key);
+  g_free(key);
+  if (data == NULL) return;
+  printf("Item %s emitted signal %s\n", sender, signal_name);
+  handler(data, param);
+}
 
-  data->category = get_property_string(proxy, "Category");
-  data->id = get_property_string(proxy, "Id");
-  data->title = get_property_string(proxy, "Title");
-  data->status = get_property_string(proxy, "Status");
+// a string (or object path) property out of a GetAll reply, NULL if missing
+static void set_string(ItemData *data, gchar **field, GVariant *props,
+                       const gchar *prop) {
+  GVariant *v = g_variant_lookup_value(props, prop, NULL);
+  const gchar *str = NULL;
+  if (v != NULL && (g_variant_is_of_type(v, G_VARIANT_TYPE_STRING) ||
+                    g_variant_is_of_type(v, G_VARIANT_TYPE_OBJECT_PATH)))
+    str = g_variant_get_string(v, NULL);
+  item_set(data, field, str);
+  if (v != NULL) g_variant_unref(v);
+}
+
+static void apply_properties(ItemData *data, GVariant *props) {
+  set_string(data, &data->category, props, "Category");
+  set_string(data, &data->id, props, "Id");
+  set_string(data, &data->title, props, "Title");
+  set_string(data, &data->status, props, "Status");
   // windowid
-  // printf("%s\n", get_property_string(proxy, "IconName"));
-  if ((data->icon_name = get_property_string(proxy, "IconName")) != NULL) {
-    printf("%s\n", data->icon_name);
-    ensure_icon_path(proxy, data->icon_name, &(data->icon_path));
-  }
-  data->theme_path = get_property_string(proxy, "IconThemePath");
-  apply_cached_prop_pixmap(proxy, "IconPixmap", &(data->icon_pixmap));
-  data->overlay_name = get_property_string(proxy, "OverlayIconName");
-  data->att_name = get_property_string(proxy, "AttentionIconName");
-  data->movie_name = get_property_string(proxy, "AttentionMovieName");
-  data->ismenu = get_property_bool(proxy, "ItemIsMenu");
-  data->menu = get_property(proxy, "Menu");
+  set_string(data, &data->theme_path, props, "IconThemePath");
+  set_string(data, &data->icon_name, props, "IconName");
+  ensure_icon_path(data, data->icon_name, &(data->icon_path));
+  apply_prop_pixmap(g_variant_lookup_value(props, "IconPixmap", NULL),
+                    "IconPixmap", &(data->icon_pixmap));
+  set_string(data, &data->overlay_name, props, "OverlayIconName");
+  set_string(data, &data->att_name, props, "AttentionIconName");
+  set_string(data, &data->movie_name, props, "AttentionMovieName");
+  data->ismenu = FALSE;
+  g_variant_lookup(props, "ItemIsMenu", "b", &data->ismenu);
+  if (data->menu) g_variant_unref(data->menu);
+  data->menu = g_variant_lookup_value(props, "Menu", NULL);
   // tooltip
+}
+
+// called once per item whose load has ended, however it ended
+static void load_finished() {
+  inflight--;
+  start_loads();
+}
+
+static void on_item_properties(GObject *source, GAsyncResult *res,
+                               gpointer user_data) {
+  GError *error = NULL;
+  GVariant *reply =
+      g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &error);
+  if (reply == NULL) {
+    // cancelled means the item is already gone, don't touch it
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      ItemData *data = user_data;
+      fprintf(stderr, "Couldn't load %s: %s\n", data->dbus_name,
+              error->message);
+      data->refreshing = FALSE;
+      data->loaded = TRUE;
+      health_fail(data, error);
+      retry_if_empty(data);
+      // signals that came in while we were waiting. a degraded item gets a
+      // full GetAll from its next probe anyway
+      if (data->refresh_again && !data->health.degraded)
+        fetch_properties(data);
+      data->refresh_again = FALSE;
+      items_changed();
+    }
+    g_error_free(error);
+    return;
+  }
+  ItemData *data = user_data;
+  GVariant *props = g_variant_get_child_value(reply, 0);
+  apply_properties(data, props);
+  data->refreshing = FALSE;
+  data->loaded = TRUE;
+  health_ok(data);
   print_data(data);
+  g_variant_unref(props);
+  g_variant_unref(reply);
+  // signals that came in while we were waiting
+  if (data->refresh_again) fetch_properties(data);
+  items_changed();
+}
+
+static void on_item_loaded(GObject *source, GAsyncResult *res,
+                           gpointer user_data) {
+  load_finished();
+  on_item_properties(source, res, user_data);
+}
+
+// re-read everything with one GetAll. items tend to send several signals in
+// a row, those are coalesced into at most one more GetAll after the one in
+// flight
+static void fetch_properties(ItemData *data) {
+  if (data->refreshing) {
+    data->refresh_again = TRUE;
+    return;
+  }
+  data->refreshing = TRUE;
+  data->refresh_again = FALSE;
+  g_dbus_proxy_call(data->proxy, "org.freedesktop.DBus.Properties.GetAll",
+                    g_variant_new("(s)", "org.kde.StatusNotifierItem"),
+                    G_DBUS_CALL_FLAGS_NONE, REFRESH_TIMEOUT, data->cancel,
+                    on_item_properties, data);
+}
+
+static void on_item_proxy(GObject *source, GAsyncResult *res,
+                          gpointer user_data) {
+  GError *error = NULL;
+  GDBusProxy *proxy = g_dbus_proxy_new_for_bus_finish(res, &error);
+  if (proxy == NULL) {
+    load_finished();
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      ItemData *data = user_data;
+      fprintf(stderr, "Couldn't create proxy for %s: %s\n", data->dbus_name,
+              error->message);
+      data->loaded = TRUE;
+      health_fail(data, error);
+      retry_if_empty(data);
+      items_changed();
+    }
+    g_error_free(error);
+    return;
+  }
+  ItemData *data = user_data;
+  data->proxy = proxy;
+  route_item(data);
+  // the slot stays taken until GetAll is answered too
+  data->refreshing = TRUE;
+  g_dbus_proxy_call(proxy, "org.freedesktop.DBus.Properties.GetAll",
+                    g_variant_new("(s)", "org.kde.StatusNotifierItem"),
+                    G_DBUS_CALL_FLAGS_NONE, LOAD_TIMEOUT, data->cancel,
+                    on_item_loaded, data);
+}
+
+// hand out free loading slots to queued items. every item goes through
+// proxy creation and GetAll without blocking, so a full tray takes about as
+// long as its slowest item instead of the sum of all of them
+static void start_loads() {
+  while (inflight < max_inflight && !g_queue_is_empty(&load_queue)) {
+    ItemData *data = g_queue_pop_head(&load_queue);
+    inflight++;
+    // signals come through the connection wide subscription, the proxy
+    // doesn't need match rules of its own
+    g_dbus_proxy_new_for_bus(G_BUS_TYPE_SESSION,
+                             G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                 G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                             NULL, data->dbus_name, data->object_path,
+                             "org.kde.StatusNotifierItem", data->cancel,
+                             on_item_proxy, data);
+  }
+}
+
+// item is "bus_name/object/path"; items that register with just a bus name
+// use the default object path
+static void parse_item_name(const gchar *item, gchar **name, gchar **path) {
+  const gchar *slash = strchr(item, '/');
+  if (slash == NULL) {
+    *name = g_strdup(item);
+    *path = g_strdup("/StatusNotifierItem");
+  } else {
+    *name = g_strndup(item, slash - item);
+    *path = g_strdup(slash);
+  }
+}
+
+// the item gets a placeholder slot right away, in the order the watcher
+// reported it, and its properties arrive whenever it gets around to answering
+static void add_item(const gchar *item) {
+  gchar *name, *path;
+  parse_item_name(item, &name, &path);
+  if (registry_lookup(name, path)) {
+    printf("%s is already in the tray\n", item);
+    g_free(name);
+    g_free(path);
+    return;
+  }
+  ItemData *data = g_new0(ItemData, 1);
+  data->strings = g_string_chunk_new(ARENA_CHUNK);
+  item_set(data, &data->dbus_name, name);
+  item_set(data, &data->object_path, path);
+  g_free(name);
+  g_free(path);
+  printf("name: %s, path: %s\n", data->dbus_name, data->object_path);
+  data->cancel = g_cancellable_new();
+  registry_add(data);
+  g_queue_push_tail(&load_queue, data);
+  start_loads();
+}
+
+// stop everything still going on for the item, take it out of the tray and
+// free it. replies still on their way see the cancellable and leave the item
+// alone
+static void remove_item(ItemData *data) {
+  g_cancellable_cancel(data->cancel);
+  g_queue_remove(&load_queue, data);
+  if (data->health.retry_id) dbus_source_remove(data->health.retry_id);
+  unroute_item(data);
+  registry_remove(data);
+
+  if (data->proxy) g_object_unref(data->proxy);
+  g_object_unref(data->cancel);
+  pixmap_free(data->icon_pixmap);
+  pixmap_free(data->att_pixmap);
+  if (data->menu) g_variant_unref(data->menu);
+  if (data->view) item_view_unref(data->view);
+  g_string_chunk_free(data->strings);
+  g_free(data);
+}
+
+// an item whose connection is gone will never unregister itself, so drop
+// every item that was served by a unique name when it disappears
+static void on_name_owner_changed(GDBusConnection *c, const gchar *sender,
+                                  const gchar *path, const gchar *iface,
+                                  const gchar *signal_name, GVariant *param,
+                                  gpointer user_data) {
+  const gchar *name, *old_owner, *new_owner;
+  g_variant_get(param, "(&s&s&s)", &name, &old_owner, &new_owner);
+  if (*new_owner != '\0' || *old_owner == '\0') return;
+  gpointer owner, served;
+  // taken out of the index first, remove_item() would edit it under us
+  if (!g_hash_table_steal_extended(by_owner, old_owner, &owner, &served))
+    return;
+  GPtrArray *items = served;
+  for (guint i = 0; i < items->len; i++) {
+    ItemData *data = g_ptr_array_index(items, i);
+    printf("%s lost its connection\n", data->dbus_name);
+    remove_item(data);
+  }
+  g_free(owner);
+  g_ptr_array_unref(items);
+  items_changed();
 }
 
 static void watcher_appeared_handler(GDBusConnection *c, const gchar *name,
@@ -266,6 +959,11 @@ static void watcher_appeared_handler(GDBusConnection *c, const gchar *name,
   g_dbus_connection_call_sync(
       c, watcher, watcher_path, watcher, "RegisterStatusNotifierHost",
       g_variant_new("(s)", host), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+  init_signal_routing(c);
+  g_dbus_connection_signal_subscribe(
+      c, "org.freedesktop.DBus", "org.freedesktop.DBus", "NameOwnerChanged",
+      "/org/freedesktop/DBus", NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+      on_name_owner_changed, NULL, NULL);
 
   proxy = g_dbus_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION,
                                         G_DBUS_PROXY_FLAGS_NONE, NULL, watcher,
@@ -279,22 +977,17 @@ static void watcher_appeared_handler(GDBusConnection *c, const gchar *name,
       g_dbus_proxy_get_cached_property(proxy, "RegisteredStatusNotifierItems");
   GVariantIter *it = g_variant_iter_new(items);
   GVariant *content;
-  ItemData *data;
   int i = 0;
   while ((content = g_variant_iter_next_value(it))) {
     const gchar *it_name = g_variant_get_string(content, NULL);
-    gchar *just_name =
-        g_strndup(it_name, g_strstr_len(it_name, -1, "/") - it_name);
     printf("%d: %s\n", i, it_name);
-    data = g_new0(ItemData, 1);
-    // extract object path from item name
-    init_item_data(just_name, g_strstr_len(it_name, -1, "/"), data);
-    list = g_list_prepend(list, data);
+    add_item(it_name);
+    g_variant_unref(content);
     i++;
   }
   g_variant_iter_free(it);
   g_variant_unref(items);
-  draw_tray();
+  items_changed();
 }
 
 static void watcher_vanished_handler(GDBusConnection *c, const gchar *name,
@@ -315,6 +1008,55 @@ static void on_name_lost(GDBusConnection *c, const gchar *name,
   exit(1);
 }
 
+// SIGHUP: re-read the icon theme setting and look every icon up again
+static gboolean on_sighup(gpointer user_data) {
+  g_free(theme);
+  theme = get_icon_theme();
+  printf("Reloading icon theme %s\n", theme);
+  icons_invalidate();
+  for (guint i = 0; i < slots->len; i++) {
+    ItemData *data = g_ptr_array_index(slots, i);
+    ensure_icon_path(data, data->icon_name, &(data->icon_path));
+  }
+  publish_damage_all = TRUE;
+  items_changed();
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean dbus_report(gpointer user_data) {
+  click_latency_report();
+  item_health_report();
+  item_memory_report();
+  snapshot_report();
+  return G_SOURCE_REMOVE;
+}
+
+// SIGUSR1: dump cache and performance counters, each thread its own
+static gboolean on_sigusr1(gpointer user_data) {
+  surface_cache_report();
+  frame_report();
+  g_main_context_invoke(dbus_ctx, dbus_report, NULL);
+  return G_SOURCE_CONTINUE;
+}
+
+static gpointer dbus_thread(gpointer user_data) {
+  GMainLoop *loop = g_main_loop_new(dbus_ctx, FALSE);
+  // async calls, signal subscriptions and name watches all deliver to the
+  // thread-default context they were started from
+  g_main_context_push_thread_default(dbus_ctx);
+  dbus_source_add(g_unix_signal_source_new(SIGHUP), on_sighup, NULL);
+  guint id = g_bus_own_name(G_BUS_TYPE_SESSION, (const gchar *)host,
+                            G_BUS_NAME_OWNER_FLAGS_NONE, NULL,
+                            on_name_acquired, on_name_lost, NULL, NULL);
+
+  g_main_loop_run(loop);
+
+  g_bus_unown_name(id);
+  g_main_context_pop_thread_default(dbus_ctx);
+  g_main_loop_unref(loop);
+  return NULL;
+}
+
 int main() {
   theme = get_icon_theme();
   printf("%s\n", theme);
@@ -322,20 +1064,25 @@ int main() {
   // printf("%s\n", icon);
   GMainLoop *loop;
   GWaterXcbSource *source;
-  guint id;
   sprintf(host + strlen(host), "%ld", (long)getpid());
   printf("name: %s\n", host);
+  slots = g_ptr_array_new();
+  by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  const gchar *env = g_getenv("SNI_TRAY_INFLIGHT");
+  if (env != NULL && atoi(env) > 0) max_inflight = atoi(env);
   init_window();
 
+  dbus_ctx = g_main_context_new();
+  GThread *dbus = g_thread_new("dbus", dbus_thread, NULL);
+
+  // this thread only handles X events and paints
   loop = g_main_loop_new(NULL, FALSE);
+  g_unix_signal_add(SIGUSR1, on_sigusr1, NULL);
   source = g_water_xcb_source_new_for_connection(NULL, c, callback, NULL, NULL);
-  id = g_bus_own_name(G_BUS_TYPE_SESSION, (const gchar *)host,
-                      G_BUS_NAME_OWNER_FLAGS_NONE, NULL, on_name_acquired,
-                      on_name_lost, NULL, NULL);
 
   g_main_loop_run(loop);
 
-  g_bus_unown_name(id);
+  g_thread_unref(dbus);
   g_main_loop_unref(loop);
   g_water_xcb_source_free(source);
   return 0;
@@ -12,12 +12,44 @@
 typedef struct Pixmap {
   gint32 width;
   gint32 height;
-  GBytes *pixmap;
+  // the ay from the reply, ARGB32 in network byte order. we keep a reference
+  // to it and point into it instead of copying
+  GVariant *bytes;
+  const guchar *data;
+  // unique per Pixmap, so draw.c can cache the converted surface
+  guint64 serial;
 } Pixmap;
+// log2 histogram of reply times, bucket b counts replies that took
+// [2^(b-1), 2^b) us
+#define LATENCY_BUCKETS 26
+typedef struct LatencyHist {
+  guint buckets[LATENCY_BUCKETS];
+  guint count;
+  guint timeouts;
+  guint errors;
+} LatencyHist;
+// how well an item has been answering us
+typedef struct ItemHealth {
+  guint timeouts;
+  guint errors;
+  // failures since the last successful call
+  guint failures;
+  // degraded items are shown from cached state and only probed now and then
+  gboolean degraded;
+  guint backoff;
+  guint retry_id;
+} ItemHealth;
 // struct to hold all properties for item
 typedef struct ItemData {
   GDBusProxy *proxy;
   gchar *dbus_name;
+  gchar *object_path;
+  // "unique_name object_path", what the signal router knows the item by
+  gchar *route_key;
+  // unique name of the connection serving the item
+  gchar *owner;
+  // position in the tray, changes when an item before it goes away
+  guint slot;
   gchar *category;
   gchar *id;
   gchar *title;
@@ -35,11 +67,59 @@ typedef struct ItemData {
 
   gboolean ismenu;
   GVariant *menu;
+
+  // FALSE until the first GetAll reply (or error) arrives
+  gboolean loaded;
+  // cancelled when the item goes away, so late replies are dropped
+  GCancellable *cancel;
+  // how long the item takes to answer clicks
+  LatencyHist clicks;
+  ItemHealth health;
+  // a GetAll is in flight, and whether another one is needed after it
+  gboolean refreshing;
+  gboolean refresh_again;
+
+  // backs all of the strings above, freed with the item
+  GStringChunk *strings;
+  // bytes put into strings since it was last compacted
+  gsize arena_used;
+  // what the render thread was last given of the item, reused by the next
+  // snapshot as long as it still matches
+  struct ItemView *view;
 } ItemData;
 
-extern GList *list;
+// what the render thread gets to see of an item. views never change once
+// published and are refcounted (g_atomic_rc_box), so a view is shared by
+// every snapshot the item didn't change in
+typedef struct ItemView {
+  gchar *dbus_name;
+  gchar *object_path;
+  gboolean loaded;
+  gchar *icon_path;
+  Pixmap *icon_pixmap;  // shares the pixel bytes with the item's
+} ItemView;
+
+// the tray as the D-Bus thread saw it at one point. owned by whoever took
+// it off the queue
+typedef struct TraySnapshot {
+  guint n;
+  ItemView **items;
+  // everything has to be drawn again, e.g. the icon theme changed
+  gboolean damage_all;
+} TraySnapshot;
+
+// for the render thread: the oldest snapshot not taken yet, or NULL
+TraySnapshot *snapshot_pop();
+void snapshot_free(TraySnapshot *s);
 
-void call_method(int click_type, int event_x, int event_y, int root_x,
+// for the render thread: click view's item, the call itself is made (and
+// timed) on the D-Bus thread
+void call_method(int click_type, const ItemView *view, int root_x,
                  int root_y);
+void click_latency_report();
+void item_health_report();
+void item_memory_report();
 gchar *find_icon(gchar *icon, gint size, gchar *theme);
+void icons_invalidate();
+void pixmap_free(Pixmap *px);
 gchar *get_icon_theme();
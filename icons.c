@@ -1,4 +1,7 @@
 #include "gdbus.h"
+
+#include <sys/stat.h>
+
 #define HAS_SUFFIX(name)                                               \
   (g_str_has_suffix(name, ".svg") || g_str_has_suffix(name, ".png") || \
    g_str_has_suffix(name, ".xpm"))
@@ -11,125 +14,456 @@
 // TODO get IconThemePath
 // TODO Add scales?
 //
-static gchar *find_icon_helper(gchar *icon, gint size, gchar *theme);
-static gchar *lookup_icon(GKeyFile *kf, gchar *name, gint size,
-                          gchar *theme_path);
+typedef struct IconTheme IconTheme;
+typedef struct IconDir IconDir;
+static GPtrArray *get_theme_chain(const gchar *theme);
+static gchar *lookup_icon(IconTheme *t, gchar *name, gint size);
 // this will be for /usr/share/pixmaps
 static gchar *lookup_fallback_icon(gchar *name);
-static gboolean dir_match_size(GKeyFile *kf, gchar *subdir, gint icon_size);
-static gint dir_size_dist(GKeyFile *kf, gchar *subdir, gint icon_size);
+static gboolean dir_match_size(const IconDir *d, gint icon_size);
+static gint dir_size_dist(const IconDir *d, gint icon_size);
 static gchar *get_theme_location(const gchar *theme);
 
+// supported icon file extensions, in the order the spec says to prefer them
+enum { EXT_PNG = 1 << 0, EXT_SVG = 1 << 1, EXT_XPM = 1 << 2 };
+static const gchar *const ext_names[] = {".png", ".svg", ".xpm"};
+
+// one place an icon name was found: the index of the subdir in the theme's
+// Directories list and a mask of which extensions exist there
+typedef struct IconEntry {
+  guint16 dir;
+  guint8 exts;
+} IconEntry;
+
+typedef enum { DIR_FIXED, DIR_SCALED, DIR_THRESHOLD, DIR_UNKNOWN } DirType;
+
+// the size keys of one subdir section of index.theme, with defaults applied
+struct IconDir {
+  gchar *name;
+  DirType type;
+  gint size;  // 0 if the section has no Size, which never matches
+  gint min;
+  gint max;
+  gint thresh;
+};
+
+// everything we need from a theme, parsed once on first use
+struct IconTheme {
+  gchar *path;  // NULL if the theme isn't installed or index.theme is broken
+  IconDir *dirs;
+  guint n_dirs;
+  gchar **parents;    // Inherits, as written
+  GPtrArray *chain;   // this theme, its ancestors and hicolor, built lazily
+  GHashTable *index;  // icon name -> GArray of IconEntry, in dirs order
+  // icon-theme.cache, if there's an up to date one; used instead of index
+  GMappedFile *cache;
+  const guchar *cache_data;
+  gsize cache_len;
+  gint *cache_dirs;  // cache directory index -> dirs index, or -1
+  guint cache_n_dirs;
+};
+
+// icon-theme.cache as written by gtk-update-icon-cache: all offsets are
+// big endian and relative to the start of the file
+#define CACHE_MAJOR 1
+#define CACHE_MINOR 0
+#define CACHE_FLAG_XPM (1 << 0)
+#define CACHE_FLAG_SVG (1 << 1)
+#define CACHE_FLAG_PNG (1 << 2)
+// the most images a single icon name can have in one theme that we look at
+#define CACHE_MAX_IMAGES 64
+
+// theme name -> IconTheme
+static GHashTable *themes = NULL;
+
+// how many unresolvable (name, size, theme) lookups we remember
+#define MISS_CACHE_SIZE 256
+// "theme\nsize\nname" -> generation the miss was recorded in
+static GHashTable *misses = NULL;
+// keys of misses, oldest first, so we know what to evict
+static GQueue miss_order = G_QUEUE_INIT;
+// bumped by icons_invalidate(), misses from older generations don't count
+static guint icon_generation = 1;
+
+static gchar *miss_key(const gchar *icon, gint size, const gchar *theme) {
+  return g_strdup_printf("%s\n%d\n%s", theme, size, icon);
+}
+
+static void remember_miss(gchar *key) {
+  if (misses == NULL)
+    misses = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  if (g_hash_table_contains(misses, key)) {
+    // stale entry from an older generation, keep its place in the queue
+    // (insert keeps the existing key and frees ours)
+    g_hash_table_insert(misses, key, GUINT_TO_POINTER(icon_generation));
+    return;
+  }
+  if (g_hash_table_size(misses) >= MISS_CACHE_SIZE)
+    g_hash_table_remove(misses, g_queue_pop_head(&miss_order));
+  g_hash_table_insert(misses, key, GUINT_TO_POINTER(icon_generation));
+  g_queue_push_tail(&miss_order, key);
+}
+
+// forget every theme we've loaded and every miss we've recorded, e.g. after
+// the icon theme changed or new icons were installed
+void icons_invalidate() {
+  icon_generation++;
+  if (themes != NULL) g_hash_table_remove_all(themes);
+}
+
 // TODO or have global theme in struct?
 gchar *find_icon(gchar *icon, gint size, gchar *theme) {
   printf("find_icon: icon: %s, theme: %s\n", icon, theme);
-  gchar *filename = find_icon_helper(icon, size, theme);
-  if (filename != NULL) return filename;
+  if (theme == NULL) theme = "hicolor";
+  gchar *key = miss_key(icon, size, theme), *filename = NULL;
+  if (misses != NULL && GPOINTER_TO_UINT(g_hash_table_lookup(
+                            misses, key)) == icon_generation) {
+    g_free(key);
+    return NULL;
+  }
+
+  GPtrArray *chain = get_theme_chain(theme);
+  for (guint i = 0; i < chain->len && filename == NULL; i++)
+    filename = lookup_icon(g_ptr_array_index(chain, i), icon, size);
+  if (filename == NULL) filename = lookup_fallback_icon(icon);
 
-  filename = find_icon_helper(icon, size, "hicolor");
-  if (filename != NULL) return filename;
+  if (filename == NULL)
+    remember_miss(key);
+  else
+    g_free(key);
+  return filename;
+}
 
-  return lookup_fallback_icon(icon);
+static guint8 ext_flag(const gchar *filename, gsize len) {
+  if (len < 4) return 0;
+  for (guint i = 0; i < G_N_ELEMENTS(ext_names); i++)
+    if (strcmp(filename + len - 4, ext_names[i]) == 0) return 1 << i;
+  return 0;
 }
 
-static gchar *find_icon_helper(gchar *icon, gint size, gchar *theme) {
+// list every subdir once and remember where each icon name lives, so a
+// lookup is a hash probe instead of a readdir of the whole theme
+static GHashTable *build_theme_index(IconTheme *t) {
+  GHashTable *index = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+  gchar name[256];
+  for (guint i = 0; i < t->n_dirs; i++) {
+    gchar *enddir = g_build_filename(t->path, t->dirs[i].name, NULL);
+    GDir *dir = g_dir_open(enddir, 0, NULL);
+    g_free(enddir);
+    if (dir == NULL) continue;
+    const gchar *filename;
+    while ((filename = g_dir_read_name(dir)) != NULL) {
+      gsize len = strlen(filename);
+      guint8 ext = ext_flag(filename, len);
+      if (ext == 0 || len - 4 >= sizeof(name)) continue;
+      memcpy(name, filename, len - 4);
+      name[len - 4] = '\0';
+
+      GArray *entries = g_hash_table_lookup(index, name);
+      if (entries == NULL) {
+        entries = g_array_sized_new(FALSE, FALSE, sizeof(IconEntry), 1);
+        g_hash_table_insert(index, g_strdup(name), entries);
+      }
+      IconEntry *last =
+          entries->len > 0
+              ? &g_array_index(entries, IconEntry, entries->len - 1)
+              : NULL;
+      if (last != NULL && last->dir == i) {
+        last->exts |= ext;
+      } else {
+        IconEntry e = {i, ext};
+        g_array_append_val(entries, e);
+      }
+    }
+    g_dir_close(dir);
+  }
+  printf("build_theme_index: %s: %u icon names\n", t->path,
+         g_hash_table_size(index));
+  return index;
+}
+
+static void parse_theme_dir(GKeyFile *kf, const gchar *subdir, IconDir *d) {
+  gchar *type = g_key_file_get_string(kf, subdir, "Type", NULL);
+  d->name = g_strdup(subdir);
+  if (type == NULL || g_strcmp0(type, "Threshold") == 0)
+    d->type = DIR_THRESHOLD;
+  else if (g_strcmp0(type, "Fixed") == 0)
+    d->type = DIR_FIXED;
+  else if (g_strcmp0(type, "Scaled") == 0)
+    d->type = DIR_SCALED;
+  else
+    d->type = DIR_UNKNOWN;
+  g_free(type);
+  d->size = g_key_file_get_integer(kf, subdir, "Size", NULL);
+  if ((d->min = g_key_file_get_integer(kf, subdir, "MinSize", NULL)) == 0)
+    d->min = d->size;
+  if ((d->max = g_key_file_get_integer(kf, subdir, "MaxSize", NULL)) == 0)
+    d->max = d->size;
+  if ((d->thresh = g_key_file_get_integer(kf, subdir, "Threshold", NULL)) == 0)
+    d->thresh = 2;
+}
+
+static gboolean load_theme(IconTheme *t) {
   GError *err = NULL;
   GKeyFile *kf = g_key_file_new();
+  gchar **dirs = NULL;
   g_key_file_set_list_separator(kf, ',');
-  gchar *theme_path = get_theme_location(theme), *filename = NULL;
-  gchar **parents = NULL;
-  if (theme_path == NULL) {
-    fprintf(stderr, "Error finding theme %s\n", theme);
-    return NULL;
-  }
-  printf("find_icon_helper: theme_path: %s\n", theme_path);
-  gchar *theme_index = g_build_filename(theme_path, "index.theme", NULL);
-  if (g_key_file_load_from_file(kf, theme_index, G_KEY_FILE_NONE, &err)) {
-    filename = lookup_icon(kf, icon, size, theme_path);
-    if (filename != NULL) {
-      goto cleanup;
-    }
-    if ((parents = g_key_file_get_string_list(kf, "Icon Theme", "Inherits",
-                                              NULL, NULL)) != NULL) {
-      for (int i = 0; parents[i] != NULL; i++) {
-        filename = find_icon_helper(icon, size, parents[i]);
-        if (filename != NULL) {
-          goto cleanup;
-        }
-      }
-    }
-  } else {
-    fprintf(stderr, "Error loading %s: %s\n", theme_path, err->message);
+  gchar *theme_index = g_build_filename(t->path, "index.theme", NULL);
+  if (!g_key_file_load_from_file(kf, theme_index, G_KEY_FILE_NONE, &err)) {
+    fprintf(stderr, "Error loading %s: %s\n", t->path, err->message);
     g_error_free(err);
+  } else if ((dirs = g_key_file_get_string_list(kf, "Icon Theme",
+                                                "Directories", NULL, &err)) ==
+             NULL) {
+    fprintf(stderr, "Error loading index.theme: %s\n", err->message);
+    g_error_free(err);
+  } else {
+    t->n_dirs = MIN(g_strv_length(dirs), G_MAXUINT16 + 1);
+    t->dirs = g_new0(IconDir, t->n_dirs);
+    for (guint i = 0; i < t->n_dirs; i++)
+      parse_theme_dir(kf, dirs[i], &t->dirs[i]);
+    t->parents =
+        g_key_file_get_string_list(kf, "Icon Theme", "Inherits", NULL, NULL);
   }
-cleanup:
+  g_strfreev(dirs);
   g_free(theme_index);
-  g_free(theme_path);
   g_key_file_free(kf);
-  g_strfreev(parents);
-  return filename;
+  return t->dirs != NULL;
 }
 
-static gchar *lookup_icon(GKeyFile *kf, gchar *icon, gint size,
-                          gchar *theme_path) {
-  GError *err = NULL;
-  GDir *dir;
-  const gchar *filename;
-  gchar *enddir, *closest = NULL, *name;
-  gchar **dirs;
-  gpointer dot;
-  gint min_size = G_MAXINT;
-  if ((dirs = g_key_file_get_string_list(kf, "Icon Theme", "Directories", NULL,
-                                         &err)) != NULL) {
-    for (int i = 0; dirs[i] != NULL; i++) {
-      enddir = g_build_filename(theme_path, dirs[i], NULL);
-      if ((dir = g_dir_open(enddir, 0, NULL)) != NULL) {
-        while ((filename = g_dir_read_name(dir)) != NULL) {
-          if ((dot = g_strrstr_len(filename, -1, ".")) != NULL) {
-            name = g_strndup(filename, dot - (gpointer)filename);
-            if ((g_strcmp0(name, icon) == 0) &&
-                dir_match_size(kf, dirs[i], size) && HAS_SUFFIX(filename)) {
-              g_strfreev(dirs);
-              // printf("%s\n", filename);
-              g_free(name);
-              closest = g_build_filename(enddir, filename, NULL);
-              g_dir_close(dir);
-              g_free(enddir);
-              return closest;
-            }
-            g_free(name);
-          }
-        }
-        g_dir_close(dir);
+static gboolean cache_u16(IconTheme *t, guint32 off, guint16 *out) {
+  if (off > t->cache_len || t->cache_len - off < 2) return FALSE;
+  *out = (t->cache_data[off] << 8) | t->cache_data[off + 1];
+  return TRUE;
+}
+
+static gboolean cache_u32(IconTheme *t, guint32 off, guint32 *out) {
+  if (off > t->cache_len || t->cache_len - off < 4) return FALSE;
+  const guchar *p = t->cache_data + off;
+  *out = ((guint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  return TRUE;
+}
+
+// a NUL terminated string inside the mapping, or NULL if off is bogus
+static const gchar *cache_str(IconTheme *t, guint32 off) {
+  if (off >= t->cache_len) return NULL;
+  if (memchr(t->cache_data + off, '\0', t->cache_len - off) == NULL)
+    return NULL;
+  return (const gchar *)t->cache_data + off;
+}
+
+// same hash gtk uses to build the table
+static guint32 cache_hash(const gchar *name) {
+  const signed char *p = (const signed char *)name;
+  guint32 h = *p;
+  if (h)
+    for (p += 1; *p != '\0'; p++) h = (h << 5) - h + *p;
+  return h;
+}
+
+static void unload_theme_cache(IconTheme *t) {
+  if (t->cache) g_mapped_file_unref(t->cache);
+  g_free(t->cache_dirs);
+  t->cache = NULL;
+  t->cache_data = NULL;
+  t->cache_len = 0;
+  t->cache_dirs = NULL;
+  t->cache_n_dirs = 0;
+}
+
+// map icon-theme.cache if it exists and is at least as new as the theme
+// directory (the same freshness rule gtk uses), and work out which of its
+// directories correspond to the ones in index.theme
+static gboolean load_theme_cache(IconTheme *t) {
+  struct stat dir_st, cache_st;
+  guint16 major, minor;
+  guint32 dir_list, n_dirs;
+  gchar *cache_path = g_build_filename(t->path, "icon-theme.cache", NULL);
+  if (stat(t->path, &dir_st) < 0 || stat(cache_path, &cache_st) < 0 ||
+      cache_st.st_mtime < dir_st.st_mtime) {
+    g_free(cache_path);
+    return FALSE;
+  }
+  t->cache = g_mapped_file_new(cache_path, FALSE, NULL);
+  g_free(cache_path);
+  if (t->cache == NULL) return FALSE;
+  t->cache_data = (const guchar *)g_mapped_file_get_contents(t->cache);
+  t->cache_len = g_mapped_file_get_length(t->cache);
+
+  if (!cache_u16(t, 0, &major) || !cache_u16(t, 2, &minor) ||
+      major != CACHE_MAJOR || minor != CACHE_MINOR ||
+      !cache_u32(t, 8, &dir_list) || !cache_u32(t, dir_list, &n_dirs) ||
+      n_dirs > (t->cache_len - dir_list) / 4) {
+    fprintf(stderr, "Ignoring bad icon cache in %s\n", t->path);
+    unload_theme_cache(t);
+    return FALSE;
+  }
+
+  GHashTable *by_name = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint i = 0; i < t->n_dirs; i++)
+    g_hash_table_insert(by_name, t->dirs[i].name, GUINT_TO_POINTER(i + 1));
+  t->cache_n_dirs = n_dirs;
+  t->cache_dirs = g_new(gint, MAX(n_dirs, 1));
+  for (guint32 i = 0; i < n_dirs; i++) {
+    guint32 off = 0;
+    const gchar *name = NULL;
+    if (cache_u32(t, dir_list + 4 + 4 * i, &off)) name = cache_str(t, off);
+    t->cache_dirs[i] =
+        name ? (gint)GPOINTER_TO_UINT(g_hash_table_lookup(by_name, name)) - 1
+             : -1;
+  }
+  g_hash_table_destroy(by_name);
+  printf("load_theme_cache: %s: %u cached directories\n", t->path, n_dirs);
+  return TRUE;
+}
+
+static int entry_dir_cmp(const void *a, const void *b) {
+  return (int)((const IconEntry *)a)->dir - (int)((const IconEntry *)b)->dir;
+}
+
+// collect the places icon lives according to the cache, straight out of
+// the mapping. returns how many entries were written to out, in dirs order
+// like the index has them (the cache lists images in its own order), so the
+// same theme resolves to the same file with or without a cache
+static guint lookup_theme_cache(IconTheme *t, const gchar *icon,
+                                IconEntry *out) {
+  guint32 hash_off, n_buckets, node, chain, name_off, images, n_images;
+  guint found = 0;
+  if (!cache_u32(t, 4, &hash_off) || !cache_u32(t, hash_off, &n_buckets) ||
+      n_buckets == 0 ||
+      !cache_u32(t, hash_off + 4 + 4 * (cache_hash(icon) % n_buckets), &node))
+    return 0;
+
+  // the chain is terminated by 0xffffffff, which cache_u32 rejects
+  while (cache_u32(t, node, &chain) && cache_u32(t, node + 4, &name_off)) {
+    const gchar *name = cache_str(t, name_off);
+    if (name != NULL && strcmp(name, icon) == 0) {
+      if (!cache_u32(t, node + 8, &images) ||
+          !cache_u32(t, images, &n_images))
+        return 0;
+      for (guint32 i = 0; i < n_images && found < CACHE_MAX_IMAGES; i++) {
+        guint16 dir, flags;
+        if (!cache_u16(t, images + 4 + 8 * i, &dir) ||
+            !cache_u16(t, images + 6 + 8 * i, &flags))
+          break;
+        if (dir >= t->cache_n_dirs || t->cache_dirs[dir] < 0) continue;
+        guint8 exts = ((flags & CACHE_FLAG_PNG) ? EXT_PNG : 0) |
+                      ((flags & CACHE_FLAG_SVG) ? EXT_SVG : 0) |
+                      ((flags & CACHE_FLAG_XPM) ? EXT_XPM : 0);
+        if (exts == 0) continue;
+        out[found++] = (IconEntry){t->cache_dirs[dir], exts};
       }
-      g_free(enddir);
+      qsort(out, found, sizeof(IconEntry), entry_dir_cmp);
+      return found;
     }
-    for (int i = 0; dirs[i] != NULL; i++) {
-      enddir = g_build_filename(theme_path, dirs[i], NULL);
-      if ((dir = g_dir_open(enddir, 0, NULL)) != NULL) {
-        while ((filename = g_dir_read_name(dir)) != NULL) {
-          if ((dot = g_strrstr_len(filename, -1, ".")) != NULL) {
-            name = g_strndup(filename, dot - (gpointer)filename);
-            if ((g_strcmp0(name, icon) == 0) &&
-                (dir_size_dist(kf, dirs[i], size) < min_size) &&
-                HAS_SUFFIX(filename)) {
-              g_free(closest);
-              closest = g_build_filename(enddir, filename, NULL);
-              min_size = dir_size_dist(kf, dirs[i], size);
-            }
-            g_free(name);
-          }
-        }
-        g_dir_close(dir);
-      }
-      g_free(enddir);
+    node = chain;
+  }
+  return 0;
+}
+
+static void icon_theme_free(IconTheme *t) {
+  unload_theme_cache(t);
+  g_free(t->path);
+  for (guint i = 0; i < t->n_dirs; i++) g_free(t->dirs[i].name);
+  g_free(t->dirs);
+  g_strfreev(t->parents);
+  // the chain only borrows themes owned by the themes table
+  if (t->chain) g_ptr_array_unref(t->chain);
+  if (t->index) g_hash_table_destroy(t->index);
+  g_free(t);
+}
+
+static IconTheme *get_theme(const gchar *theme) {
+  if (themes == NULL)
+    themes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)icon_theme_free);
+  IconTheme *t = g_hash_table_lookup(themes, theme);
+  if (t != NULL) return t;
+
+  t = g_new0(IconTheme, 1);
+  g_hash_table_insert(themes, g_strdup(theme), t);
+  if ((t->path = get_theme_location(theme)) == NULL) {
+    fprintf(stderr, "Error finding theme %s\n", theme);
+    return t;
+  }
+  printf("get_theme: theme_path: %s\n", t->path);
+  if (load_theme(t)) {
+    // only list the theme's directories when gtk's cache can't be used
+    if (!load_theme_cache(t)) t->index = build_theme_index(t);
+  } else {
+    g_free(t->path);
+    t->path = NULL;
+  }
+  return t;
+}
+
+// depth-first over Inherits, the same order the recursive lookup used to
+// visit themes in, skipping themes we've already added
+static void add_to_chain(GPtrArray *chain, GHashTable *seen,
+                         const gchar *theme) {
+  if (!g_hash_table_add(seen, (gpointer)theme)) return;
+  IconTheme *t = get_theme(theme);
+  if (t->path == NULL) return;
+  g_ptr_array_add(chain, t);
+  for (int i = 0; t->parents != NULL && t->parents[i] != NULL; i++)
+    add_to_chain(chain, seen, t->parents[i]);
+}
+
+// every theme a lookup in theme has to search, in order, ending in hicolor
+static GPtrArray *get_theme_chain(const gchar *theme) {
+  IconTheme *t = get_theme(theme);
+  if (t->chain != NULL) return t->chain;
+
+  GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+  t->chain = g_ptr_array_new();
+  add_to_chain(t->chain, seen, theme);
+  add_to_chain(t->chain, seen, "hicolor");
+  g_hash_table_destroy(seen);
+  return t->chain;
+}
+
+static gchar *entry_filename(IconTheme *t, const gchar *icon, IconEntry *e) {
+  for (guint i = 0; i < G_N_ELEMENTS(ext_names); i++) {
+    if (e->exts & (1 << i)) {
+      gchar *file = g_strconcat(icon, ext_names[i], NULL);
+      gchar *ret = g_build_filename(t->path, t->dirs[e->dir].name, file, NULL);
+      g_free(file);
+      return ret;
     }
+  }
+  return NULL;
+}
+
+static gchar *lookup_icon(IconTheme *t, gchar *icon, gint size) {
+  IconEntry cached[CACHE_MAX_IMAGES];
+  IconEntry *entries, *closest = NULL;
+  guint n_entries;
+  gint min_size = G_MAXINT;
+  if (t->cache != NULL) {
+    entries = cached;
+    n_entries = lookup_theme_cache(t, icon, cached);
   } else {
-    fprintf(stderr, "Error loading index.theme: %s\n", err->message);
-    g_error_free(err);
+    GArray *indexed;
+    if (t->index == NULL ||
+        (indexed = g_hash_table_lookup(t->index, icon)) == NULL)
+      return NULL;
+    entries = (IconEntry *)indexed->data;
+    n_entries = indexed->len;
   }
-  g_strfreev(dirs);
-  if (closest != NULL) return closest;
+
+  for (guint i = 0; i < n_entries; i++) {
+    if (dir_match_size(&t->dirs[entries[i].dir], size))
+      return entry_filename(t, icon, &entries[i]);
+  }
+  for (guint i = 0; i < n_entries; i++) {
+    gint dist = dir_size_dist(&t->dirs[entries[i].dir], size);
+    if (dist < min_size) {
+      closest = &entries[i];
+      min_size = dist;
+    }
+  }
+  if (closest != NULL) return entry_filename(t, icon, closest);
   return NULL;
 }
 
@@ -155,68 +489,37 @@ static gchar *lookup_fallback_icon(gchar *icon) {
   return NULL;
 }
 
-static gboolean dir_match_size(GKeyFile *kf, gchar *subdir, gint icon_size) {
-  gchar *type = NULL;
-  gint size, min, max, thresh;
-  if ((type = g_key_file_get_string(kf, subdir, "Type", NULL)) == NULL)
-    type = "Threshold";
-  if ((size = g_key_file_get_integer(kf, subdir, "Size", NULL)) == 0) {
-    g_free(type);
-    // no size specified, we can't do anything
-    return FALSE;
+static gboolean dir_match_size(const IconDir *d, gint icon_size) {
+  // no size specified, we can't do anything
+  if (d->size == 0) return FALSE;
+  switch (d->type) {
+    case DIR_FIXED:
+      return d->size == icon_size;
+    case DIR_SCALED:
+      return (d->min <= icon_size) && (icon_size <= d->max);
+    case DIR_THRESHOLD:
+      return (d->size - d->thresh <= icon_size) &&
+             (icon_size <= d->size + d->thresh);
+    default:
+      return FALSE;
   }
-  if (g_strcmp0(type, "Fixed") == 0) {
-    g_free(type);
-    return size == icon_size;
-  } else if (g_strcmp0(type, "Scaled") == 0) {
-    g_free(type);
-    if ((min = g_key_file_get_integer(kf, subdir, "MinSize", NULL)) == 0)
-      min = size;
-    if ((max = g_key_file_get_integer(kf, subdir, "MaxSize", NULL)) == 0)
-      max = size;
-    return (min <= icon_size) && (icon_size <= max);
-  } else if (g_strcmp0(type, "Threshold") == 0) {
-    g_free(type);
-    if ((thresh = g_key_file_get_integer(kf, subdir, "Threshold", NULL)) == 0)
-      thresh = 2;
-    return (size - thresh <= icon_size) && (icon_size <= size + thresh);
-  }
-  g_free(type);
-  return FALSE;
 }
 
-static gint dir_size_dist(GKeyFile *kf, gchar *subdir, gint icon_size) {
-  gchar *type = NULL;
-  gint size, min, max, thresh;
-  if ((type = g_key_file_get_string(kf, subdir, "Type", NULL)) == NULL)
-    type = "Threshold";
-  if ((size = g_key_file_get_integer(kf, subdir, "Size", NULL)) == 0) {
-    g_free(type);
-    return G_MAXINT;
-  }
-  if (g_strcmp0(type, "Fixed") == 0) {
-    g_free(type);
-    return ABS(size - icon_size);
-  } else {
-    if ((min = g_key_file_get_integer(kf, subdir, "MinSize", NULL)) == 0)
-      min = size;
-    if ((max = g_key_file_get_integer(kf, subdir, "MaxSize", NULL)) == 0)
-      max = size;
-    if (g_strcmp0(type, "Scaled") == 0) {
-      g_free(type);
-      if (icon_size < min) return min - icon_size;
-      if (icon_size > max) return icon_size - max;
+static gint dir_size_dist(const IconDir *d, gint icon_size) {
+  if (d->size == 0) return G_MAXINT;
+  switch (d->type) {
+    case DIR_FIXED:
+      return ABS(d->size - icon_size);
+    case DIR_SCALED:
+      if (icon_size < d->min) return d->min - icon_size;
+      if (icon_size > d->max) return icon_size - d->max;
       return 0;
-    } else if (g_strcmp0(type, "Threshold") == 0) {
-      g_free(type);
-      if ((thresh = g_key_file_get_integer(kf, subdir, "Threshold", NULL)) == 0)
-        thresh = 2;
-      if (icon_size < (size - thresh)) return min - icon_size;
-      if (icon_size > (size + thresh)) return icon_size - max;
+    case DIR_THRESHOLD:
+      if (icon_size < (d->size - d->thresh)) return d->min - icon_size;
+      if (icon_size > (d->size + d->thresh)) return icon_size - d->max;
       return 0;
-    }
-    g_free(type);
-    return G_MAXINT;
+    default:
+      return G_MAXINT;
   }
 }
 
@@ -0,0 +1,70 @@
+// microbenchmark for the pixbuf -> cairo pixel converters, and a check that
+// every implementation produces exactly what the scalar one does
+// usage: bench-pixconv [width height iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pixconv.h"
+
+typedef void (*conv_fn)(const uint8_t *, int, uint8_t *, int, int, int);
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(const char *what, conv_fn conv, int channels, int width,
+                 int height, int iterations) {
+  int src_stride = width * channels, dst_stride = width * 4, failed = 0;
+  uint8_t *src = malloc((size_t)src_stride * height);
+  uint8_t *expect = malloc((size_t)dst_stride * height);
+  uint8_t *dst = malloc((size_t)dst_stride * height);
+  srand(1);
+  for (size_t i = 0; i < (size_t)src_stride * height; i++) src[i] = rand();
+
+  pixconv_set_impl(PIXCONV_SCALAR);
+  conv(src, src_stride, expect, dst_stride, width, height);
+  for (pixconv_impl_t impl = PIXCONV_SCALAR; impl <= PIXCONV_AVX2; impl++) {
+    if (!pixconv_set_impl(impl)) {
+      printf("%-6s %-6s unsupported on this cpu\n", what,
+             pixconv_impl_name(impl));
+      continue;
+    }
+    memset(dst, 0, (size_t)dst_stride * height);
+    conv(src, src_stride, dst, dst_stride, width, height);
+    int ok = memcmp(dst, expect, (size_t)dst_stride * height) == 0;
+    failed |= !ok;
+
+    double start = now();
+    for (int i = 0; i < iterations; i++)
+      conv(src, src_stride, dst, dst_stride, width, height);
+    double secs = now() - start;
+    printf("%-6s %-6s %8.1f Mpix/s %s\n", what, pixconv_impl_name(impl),
+           (double)width * height * iterations / secs / 1e6,
+           ok ? "" : "MISMATCH");
+  }
+  free(src);
+  free(expect);
+  free(dst);
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  // a full 4k frame by default
+  int width = 3840, height = 2160, iterations = 50;
+  if (argc == 4) {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+    iterations = atoi(argv[3]);
+  }
+  printf("%dx%d, %d iterations\n", width, height, iterations);
+  int failed = bench("rgba", pixconv_rgba_to_argb32, 4, width, height,
+                     iterations);
+  failed |= bench("rgb", pixconv_rgb_to_rgb24, 3, width, height, iterations);
+  failed |= bench("argb", pixconv_argb_be_to_argb32, 4, width, height,
+                  iterations);
+  return failed;
+}
@@ -0,0 +1,227 @@
+#include "pixconv.h"
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXCONV_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*row_fn)(const uint8_t *src, uint32_t *dst, int width);
+
+// x * a / 255, rounded to nearest, exact for all 8 bit x and a
+static inline uint32_t div255(uint32_t v) {
+  v += 128;
+  return (v + (v >> 8)) >> 8;
+}
+
+static void rgba_row_scalar(const uint8_t *src, uint32_t *dst, int width) {
+  for (int x = 0; x < width; x++, src += 4) {
+    uint32_t a = src[3];
+    dst[x] = (a << 24) | (div255(src[0] * a) << 16) |
+             (div255(src[1] * a) << 8) | div255(src[2] * a);
+  }
+}
+
+static void rgb_row_scalar(const uint8_t *src, uint32_t *dst, int width) {
+  for (int x = 0; x < width; x++, src += 3)
+    dst[x] = 0xff000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+}
+
+static void argb_be_row_scalar(const uint8_t *src, uint32_t *dst, int width) {
+  for (int x = 0; x < width; x++, src += 4) {
+    uint32_t a = src[0];
+    dst[x] = (a << 24) | (div255(src[1] * a) << 16) |
+             (div255(src[2] * a) << 8) | div255(src[3] * a);
+  }
+}
+
+#ifdef PIXCONV_X86
+// the vector paths write uint32 pixels as bytes, so they assume little endian
+// like every x86 does. they widen pixels to 16 bit lanes, reorder each one to
+// b, g, r, a (ARGB32 in memory) and then premultiply
+
+// v holds two b, g, r, a pixels. multiply b, g and r by a with the same
+// rounding as div255, and a by 255 so it comes out unchanged
+__attribute__((target("sse2"))) static inline __m128i premul_sse2(
+    __m128i v, __m128i amask, __m128i a255) {
+  __m128i a = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  a = _mm_or_si128(_mm_andnot_si128(amask, a), a255);
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// order is the _MM_SHUFFLE that turns one source pixel into b, g, r, a
+#define CONVERT_SSE2(order)                                                 \
+  const __m128i zero = _mm_setzero_si128();                                 \
+  const __m128i amask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);            \
+  const __m128i a255 = _mm_and_si128(amask, _mm_set1_epi16(255));           \
+  int x = 0;                                                                \
+  for (; x + 4 <= width; x += 4) {                                          \
+    __m128i px = _mm_loadu_si128((const __m128i *)(src + 4 * x));          \
+    __m128i lo = _mm_unpacklo_epi8(px, zero);                               \
+    __m128i hi = _mm_unpackhi_epi8(px, zero);                               \
+    lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, order), order);        \
+    hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, order), order);        \
+    lo = premul_sse2(lo, amask, a255);                                      \
+    hi = premul_sse2(hi, amask, a255);                                      \
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));       \
+  }
+
+__attribute__((target("sse2"))) static void rgba_row_sse2(const uint8_t *src,
+                                                           uint32_t *dst,
+                                                           int width) {
+  CONVERT_SSE2(_MM_SHUFFLE(3, 0, 1, 2));
+  rgba_row_scalar(src + 4 * x, dst + x, width - x);
+}
+
+__attribute__((target("sse2"))) static void argb_be_row_sse2(
+    const uint8_t *src, uint32_t *dst, int width) {
+  CONVERT_SSE2(_MM_SHUFFLE(0, 1, 2, 3));
+  argb_be_row_scalar(src + 4 * x, dst + x, width - x);
+}
+
+// same as premul_sse2, on four pixels. the 256 bit unpack/shuffle/pack
+// instructions all work within 128 bit lanes, so pixel order is preserved
+__attribute__((target("avx2"))) static inline __m256i premul_avx2(
+    __m256i v, __m256i amask, __m256i a255) {
+  __m256i a =
+      _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)),
+                             _MM_SHUFFLE(3, 3, 3, 3));
+  a = _mm256_or_si256(_mm256_andnot_si256(amask, a), a255);
+  __m256i t =
+      _mm256_add_epi16(_mm256_mullo_epi16(v, a), _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+#define CONVERT_AVX2(order)                                                 \
+  const __m256i zero = _mm256_setzero_si256();                              \
+  const __m256i amask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0,   \
+                                         0, 0, -1, 0, 0, 0);                \
+  const __m256i a255 = _mm256_and_si256(amask, _mm256_set1_epi16(255));     \
+  int x = 0;                                                                \
+  for (; x + 8 <= width; x += 8) {                                          \
+    __m256i px = _mm256_loadu_si256((const __m256i *)(src + 4 * x));       \
+    __m256i lo = _mm256_unpacklo_epi8(px, zero);                            \
+    __m256i hi = _mm256_unpackhi_epi8(px, zero);                            \
+    lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, order), order);  \
+    hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, order), order);  \
+    lo = premul_avx2(lo, amask, a255);                                      \
+    hi = premul_avx2(hi, amask, a255);                                      \
+    _mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(lo, hi)); \
+  }
+
+__attribute__((target("avx2"))) static void rgba_row_avx2(const uint8_t *src,
+                                                           uint32_t *dst,
+                                                           int width) {
+  CONVERT_AVX2(_MM_SHUFFLE(3, 0, 1, 2));
+  rgba_row_scalar(src + 4 * x, dst + x, width - x);
+}
+
+__attribute__((target("avx2"))) static void argb_be_row_avx2(
+    const uint8_t *src, uint32_t *dst, int width) {
+  CONVERT_AVX2(_MM_SHUFFLE(0, 1, 2, 3));
+  argb_be_row_scalar(src + 4 * x, dst + x, width - x);
+}
+
+// sse2 has no byte shuffle, so only the avx2 path (which implies ssse3) has
+// a vector version of this
+__attribute__((target("avx2"))) static void rgb_row_avx2(const uint8_t *src,
+                                                          uint32_t *dst,
+                                                          int width) {
+  // r, g, b of four pixels -> b, g, r, 0 each, in both 128 bit lanes
+  const __m256i shuf = _mm256_setr_epi8(
+      2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1, 2, 1, 0, -1, 5, 4,
+      3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+  int x = 0;
+  // each 16 byte load only uses 12, so stop while the last one is in bounds
+  for (; x + 10 <= width; x += 8) {
+    __m256i px = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i *)(src + 3 * x))),
+        _mm_loadu_si128((const __m128i *)(src + 3 * x + 12)), 1);
+    px = _mm256_or_si256(_mm256_shuffle_epi8(px, shuf), opaque);
+    _mm256_storeu_si256((__m256i *)(dst + x), px);
+  }
+  rgb_row_scalar(src + 3 * x, dst + x, width - x);
+}
+#endif
+
+static row_fn rgba_row = NULL;
+static row_fn rgb_row = NULL;
+static row_fn argb_be_row = NULL;
+
+pixconv_impl_t pixconv_best_impl() {
+#ifdef PIXCONV_X86
+  if (__builtin_cpu_supports("avx2")) return PIXCONV_AVX2;
+  if (__builtin_cpu_supports("sse2")) return PIXCONV_SSE2;
+#endif
+  return PIXCONV_SCALAR;
+}
+
+int pixconv_set_impl(pixconv_impl_t want) {
+  switch (want) {
+    case PIXCONV_SCALAR:
+      rgba_row = rgba_row_scalar;
+      rgb_row = rgb_row_scalar;
+      argb_be_row = argb_be_row_scalar;
+      break;
+#ifdef PIXCONV_X86
+    case PIXCONV_SSE2:
+      if (!__builtin_cpu_supports("sse2")) return 0;
+      rgba_row = rgba_row_sse2;
+      rgb_row = rgb_row_scalar;
+      argb_be_row = argb_be_row_sse2;
+      break;
+    case PIXCONV_AVX2:
+      if (!__builtin_cpu_supports("avx2")) return 0;
+      rgba_row = rgba_row_avx2;
+      rgb_row = rgb_row_avx2;
+      argb_be_row = argb_be_row_avx2;
+      break;
+#endif
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+const char *pixconv_impl_name(pixconv_impl_t i) {
+  switch (i) {
+    case PIXCONV_SCALAR:
+      return "scalar";
+    case PIXCONV_SSE2:
+      return "sse2";
+    case PIXCONV_AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+static void convert(row_fn *row, const uint8_t *src, int src_stride,
+                    uint8_t *dst, int dst_stride, int width, int height) {
+  if (*row == NULL) pixconv_set_impl(pixconv_best_impl());
+  for (int y = 0; y < height; y++) {
+    (*row)(src, (uint32_t *)dst, width);
+    src += src_stride;
+    dst += dst_stride;
+  }
+}
+
+void pixconv_rgba_to_argb32(const uint8_t *src, int src_stride, uint8_t *dst,
+                            int dst_stride, int width, int height) {
+  convert(&rgba_row, src, src_stride, dst, dst_stride, width, height);
+}
+
+void pixconv_rgb_to_rgb24(const uint8_t *src, int src_stride, uint8_t *dst,
+                          int dst_stride, int width, int height) {
+  convert(&rgb_row, src, src_stride, dst, dst_stride, width, height);
+}
+
+void pixconv_argb_be_to_argb32(const uint8_t *src, int src_stride,
+                               uint8_t *dst, int dst_stride, int width,
+                               int height) {
+  convert(&argb_be_row, src, src_stride, dst, dst_stride, width, height);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// converters from gdk-pixbuf's rows (R, G, B[, A] bytes, straight alpha) and
+// StatusNotifierItem pixmaps (A, R, G, B bytes, straight alpha) to cairo's
+// native endian pixels (ARGB32 premultiplied, or RGB24)
+
+typedef enum { PIXCONV_SCALAR, PIXCONV_SSE2, PIXCONV_AVX2 } pixconv_impl_t;
+
+// the fastest implementation the cpu supports, used unless one is forced
+pixconv_impl_t pixconv_best_impl();
+// returns 0 if the cpu can't run impl
+int pixconv_set_impl(pixconv_impl_t impl);
+const char *pixconv_impl_name(pixconv_impl_t impl);
+
+void pixconv_rgba_to_argb32(const uint8_t *src, int src_stride, uint8_t *dst,
+                            int dst_stride, int width, int height);
+void pixconv_rgb_to_rgb24(const uint8_t *src, int src_stride, uint8_t *dst,
+                          int dst_stride, int width, int height);
+void pixconv_argb_be_to_argb32(const uint8_t *src, int src_stride,
+                               uint8_t *dst, int dst_stride, int width,
+                               int height);